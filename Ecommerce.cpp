@@ -1,19 +1,55 @@
 #include <iostream>
 #include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
-#include <queue>
+#include <cstdint>
+#include <cmath>
 #include <map>
+#include <set>
+#include <unordered_map>
 #include <vector>
 #include <iomanip>
 #include <algorithm>
+#include <limits>
+#include <deque>
+#include <memory>
+#include <atomic>
+#include <random>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <new>
 
 #ifdef _WIN32
 #include <windows.h>
 #include <direct.h>
+#include <io.h>
+#include <fcntl.h>
 #else
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #endif
+#ifdef __linux__
+#include <csignal>
+#include <cerrno>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#endif
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+#include <malloc.h>
+#define HAVE_MALLINFO2
+#endif
 
 using namespace std;
 
@@ -33,6 +69,9 @@ namespace UI {
     const string MAGENTA = "\033[35m";
     const string CYAN = "\033[36m";
     
+    // Fast mode drops every cosmetic delay and animation
+    bool fastMode = false;
+    
     void printSuccess(const string& message) {
         cout << GREEN << BOLD << "[+] " << message << RESET << endl;
     }
@@ -58,6 +97,7 @@ namespace UI {
     }
     
     void sleepMilliseconds(int ms) {
+        if (fastMode) return;
         #ifdef _WIN32
             Sleep(ms);
         #else
@@ -65,7 +105,25 @@ namespace UI {
         #endif
     }
     
+    // Writes a whole screen section with a single write once earlier output is flushed
+    void writeBlock(const string& block) {
+        cout.flush();
+        #ifdef _WIN32
+        fwrite(block.data(), 1, block.size(), stdout);
+        fflush(stdout);
+        #else
+        fflush(stdout);
+        size_t written = 0;
+        while (written < block.size()) {
+            ssize_t n = ::write(STDOUT_FILENO, block.data() + written, block.size() - written);
+            if (n <= 0) break;
+            written += n;
+        }
+        #endif
+    }
+    
     void showLoadingAnimation(int seconds = 2) {
+        if (fastMode) return;
         cout << BLUE << BOLD << "Loading ";
         for (int i = 0; i < seconds * 2; i++) {
             cout << ">";
@@ -83,26 +141,92 @@ const char adminFile[] = "data/admin.txt";
 const char userFile[] = "data/users.txt";
 const char ordersFile[] = "data/orders.txt";
 const char productsFile[] = "data/products.txt";
+const char configFile[] = "data/config.txt";
+const char ordersLogFile[] = "data/orders.log";
+const char ordersCompactingLogFile[] = "data/orders.log.old";
+const char usersBinFile[] = "data/users.bin";
+const char productsBinFile[] = "data/products.bin";
+const char ordersBinFile[] = "data/orders.bin";
+const char ledgerFile[] = "data/ledger.log";
+const char metricsFile[] = "data/metrics.prom";
+
+// Journal records accumulated before orders.txt is rewritten in the background
+const int orderCompactionRecords = 1000;
+const int orderCompactionSeconds = 60;
+
+// Money - whole cents, so sums over any number of orders stay exact. Text
+// files keep the familiar decimal form ("4.99") through the stream operators.
+struct Money {
+    long long cents;
+
+    static Money fromCents(long long cents) {
+        Money amount;
+        amount.cents = cents;
+        return amount;
+    }
+
+    // Accepts decimal text such as "12", "4.99" or "1e3"; rounds to the nearest cent
+    static bool parse(const string& text, Money& amount) {
+        if (text.empty()) return false;
+        char* end = NULL;
+        double value = strtod(text.c_str(), &end);
+        if (*end != '\0' || !(fabs(value) < 9e15)) return false;
+        amount.cents = llround(value * 100.0);
+        return true;
+    }
+
+    string str() const {
+        char text[32];
+        unsigned long long magnitude = cents < 0 ? -(unsigned long long)cents : cents;
+        snprintf(text, sizeof(text), "%s%llu.%02llu", cents < 0 ? "-" : "", magnitude / 100, magnitude % 100);
+        return text;
+    }
+
+    Money operator+(Money other) const { return fromCents(cents + other.cents); }
+    Money operator-(Money other) const { return fromCents(cents - other.cents); }
+    Money operator*(int count) const { return fromCents(cents * count); }
+    Money& operator+=(Money other) { cents += other.cents; return *this; }
+    Money& operator-=(Money other) { cents -= other.cents; return *this; }
+    bool operator==(Money other) const { return cents == other.cents; }
+    bool operator!=(Money other) const { return cents != other.cents; }
+    bool operator<(Money other) const { return cents < other.cents; }
+    bool operator>(Money other) const { return cents > other.cents; }
+    bool operator<=(Money other) const { return cents <= other.cents; }
+    bool operator>=(Money other) const { return cents >= other.cents; }
+};
+
+ostream& operator<<(ostream& out, Money amount) {
+    return out << amount.str();
+}
+
+istream& operator>>(istream& in, Money& amount) {
+    string text;
+    if (in >> text && !Money::parse(text, amount)) {
+        in.setstate(ios::failbit);
+    }
+    return in;
+}
 
 struct Product {
     int id;
     char name[50];
-    float price;
+    Money price;
     int quantity;
-    Product* next;
 };
 
 struct User {
     char username[50];
-    char password[50];
+    char password[128];  // "pbkdf2$<iterations>$<salt>$<hash>", see Password Hashing
     char email[50];
 };
 
 struct Order {
+    long long id;  // Assigned by OrderStore, never reused
+    int productId;  // 0 when the name matches no catalog product
     char username[50];
-    char productName[50];
+    char productName[50];  // Name when ordered, for display only
     int quantity;
-    float totalAmount;
+    Money totalAmount;
     char status[20];
     int priority;
     
@@ -111,304 +235,6023 @@ struct Order {
     }
 };
 
+// The product name is looked up by id when the cart is shown
 struct CartItem {
-    char productName[50];
-    float price;
+    int productId;
+    Money price;
     int quantity;
 };
 
 
-// Global Variables
+// Epoch-based reclamation - lets writers free what they unpublished once no
+// reader can still be looking at it
+//
+// A reader announces the global epoch in its own slot before it loads a
+// shared pointer and clears the slot when done; nested reads on one thread
+// reuse the outer announcement. Every retired object is tagged with the epoch
+// it was retired in and freed once all readers still inside entered after
+// that. A writer that wants to reuse an unpublished object instead asks
+// whether those readers have left, and if it must wait, sleeps until the last
+// of them wakes it. Readers never block and only write their own cache line
+// (plus one shared load on the way out), so reads scale with threads. There is one process-wide
+// instance, since each thread's slot lives in a thread_local.
 
-priority_queue<Order> orderQueue;
-Product* productHead = NULL;
-map<string, User> userMap;
-float siteBalance = 0.0f;
-vector<CartItem> currentCart;
-int nextProductId = 1;
+class EpochManager {
+    struct ReaderSlot;
 
+public:
+    EpochManager() : globalEpoch(1), waiting(0) {}
+    EpochManager(const EpochManager&) = delete;
+    EpochManager& operator=(const EpochManager&) = delete;
 
-// Utility Functions
+    ~EpochManager() {
+        for (const Retired& object : retired) object.destroy(object.object);
+    }
 
-bool fileExists(const char* fileName) {
-    ifstream file(fileName);
-    return file.good();
-}
+    class ReadGuard {
+    public:
+        explicit ReadGuard(EpochManager& manager) : manager(manager), slot(manager.local()) {
+            if (slot.depth++ == 0) slot.epoch.store(manager.globalEpoch.load());
+        }
 
-bool containsAlphabet(const string& str) {
-    for (char c : str) {
-        if (isalpha(c)) return true;
+        ~ReadGuard() {
+            if (--slot.depth != 0) return;
+            slot.epoch.store(0, memory_order_release);
+            if (manager.waiting.load(memory_order_relaxed) > 0) {
+                lock_guard<mutex> guard(manager.lock);
+                manager.drained.notify_all();
+            }
+        }
+
+        ReadGuard(const ReadGuard&) = delete;
+        ReadGuard& operator=(const ReadGuard&) = delete;
+
+    private:
+        EpochManager& manager;
+        ReaderSlot& slot;
+    };
+
+    // Frees `object` once no reader can still see it; call after unpublishing it
+    template <typename T>
+    void retire(const T* object) {
+        lock_guard<mutex> guard(lock);
+        retired.push_back(Retired{globalEpoch.fetch_add(1), const_cast<T*>(object),
+                                  [](void* memory) { delete static_cast<T*>(memory); }});
+        reclaim();
     }
-    return false;
-}
 
-bool containsDigits(const string& str) {
-    for (char c : str) {
-        if (isdigit(c)) return true;
+    // Call after unpublishing an object that will be reused rather than freed;
+    // pass the result to idle() before changing it
+    uint64_t unpublished() {
+        return globalEpoch.fetch_add(1);
     }
-    return false;
-}
 
-bool emailValid(const string& email) {
-    return email.find('@') != string::npos && 
-           email.find('.') != string::npos;
-}
+    // True once no reader can still see what was unpublished in `epoch`; never waits
+    bool idle(uint64_t epoch) {
+        lock_guard<mutex> guard(lock);
+        return oldestReader() > epoch;
+    }
 
-string getInput(const string& prompt, bool (*validator)(const string&) = nullptr, 
-               const string& errorMsg = "Invalid input!") {
-    string input;
-    while (true) {
-        cout << UI::BOLD << prompt << UI::RESET;
-        getline(cin, input);
-        
-        if (validator == nullptr || validator(input)) {
-            return input;
+    // Sleeps until idle(epoch). Never call it inside a ReadGuard.
+    void synchronize(uint64_t epoch) {
+        unique_lock<mutex> guard(lock);
+        waiting++;
+        // The timeout covers a reader that left just before `waiting` rose
+        while (oldestReader() <= epoch) drained.wait_for(guard, chrono::milliseconds(1));
+        waiting--;
+    }
+
+    // Retired objects not freed yet
+    size_t pending() {
+        lock_guard<mutex> guard(lock);
+        return retired.size();
+    }
+
+private:
+    // 0 while the thread is outside any read. Slots come from plain new, which
+    // only promises 16-byte alignment (alignas(64) needs C++17's aligned new),
+    // so a cache line of padding on each side keeps the line holding epoch and
+    // depth to this slot alone; readers on different cores never share one.
+    struct ReaderSlot {
+        ReaderSlot() : epoch(0), depth(0) {}
+
+        char before[64];
+        atomic<uint64_t> epoch;
+        int depth;  // Only touched by the owning thread
+        char after[64 - sizeof(atomic<uint64_t>) - sizeof(int)];
+    };
+
+    struct Retired {
+        uint64_t epoch;
+        void* object;
+        void (*destroy)(void*);
+    };
+
+    struct Registration {
+        explicit Registration(EpochManager& manager) : manager(manager), slot(new ReaderSlot()) {
+            lock_guard<mutex> guard(manager.lock);
+            manager.slots.push_back(slot);
         }
-        UI::printError(errorMsg);
+
+        ~Registration() {
+            lock_guard<mutex> guard(manager.lock);
+            manager.slots.erase(find(manager.slots.begin(), manager.slots.end(), slot));
+            delete slot;
+        }
+
+        EpochManager& manager;
+        ReaderSlot* slot;
+    };
+
+    ReaderSlot& local() {
+        thread_local Registration registration(*this);
+        return *registration.slot;
+    }
+
+    // Earliest epoch a reader still inside entered in; caller holds `lock`
+    uint64_t oldestReader() const {
+        uint64_t oldest = numeric_limits<uint64_t>::max();
+        for (const ReaderSlot* slot : slots) {
+            uint64_t epoch = slot->epoch.load();
+            if (epoch != 0) oldest = min(oldest, epoch);
+        }
+        return oldest;
+    }
+
+    // A reader that entered in epoch e may hold anything retired in epoch e or later
+    void reclaim() {
+        uint64_t oldest = oldestReader();
+        size_t kept = 0;
+        for (const Retired& object : retired) {
+            if (object.epoch < oldest) {
+                object.destroy(object.object);
+            } else {
+                retired[kept++] = object;
+            }
+        }
+        retired.resize(kept);
+    }
+
+    atomic<uint64_t> globalEpoch;
+    atomic<int> waiting;  // Writers in synchronize()
+    mutex lock;  // Guards slots and retired
+    condition_variable drained;
+    vector<ReaderSlot*> slots;
+    vector<Retired> retired;
+};
+
+EpochManager epochs;
+
+
+// Arena - index nodes are carved out of large blocks instead of one heap
+// allocation each
+//
+// Freed nodes go on a free list for their size and are handed out again, so
+// churn (an order moving between status sets) never returns to malloc. Once
+// the containers using an arena are emptied, release() drops every block at
+// once. Requests larger than a node go straight to the heap. Not thread-safe:
+// each arena is guarded by the lock of the structure that owns it.
+
+class Arena {
+public:
+    explicit Arena(size_t blockSize = 1 << 20) : blockSize(blockSize), cursor(NULL), remaining(0) {
+        fill(freeLists, freeLists + sizeClasses, (FreeNode*)NULL);
+    }
+
+    ~Arena() { release(); }
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    void* allocate(size_t size) {
+        size = roundUp(size);
+        if (size > maxNodeSize) return ::operator new(size);
+
+        FreeNode*& head = freeLists[size / alignment - 1];
+        if (head != NULL) {
+            FreeNode* node = head;
+            head = node->next;
+            return node;
+        }
+        if (remaining < size) grow();
+        void* node = cursor;
+        cursor += size;
+        remaining -= size;
+        return node;
+    }
+
+    void deallocate(void* memory, size_t size) {
+        size = roundUp(size);
+        if (size > maxNodeSize) {
+            ::operator delete(memory);
+            return;
+        }
+        FreeNode* node = static_cast<FreeNode*>(memory);
+        node->next = freeLists[size / alignment - 1];
+        freeLists[size / alignment - 1] = node;
+    }
+
+    // Frees every block; nothing allocated from the arena may be touched afterwards
+    void release() {
+        for (char* block : blocks) ::operator delete(block);
+        blocks.clear();
+        cursor = NULL;
+        remaining = 0;
+        fill(freeLists, freeLists + sizeClasses, (FreeNode*)NULL);
+    }
+
+    size_t blockCount() const { return blocks.size(); }
+
+private:
+    struct FreeNode {
+        FreeNode* next;
+    };
+
+    static const size_t alignment = 16;
+    static const size_t maxNodeSize = 256;
+    static const size_t sizeClasses = maxNodeSize / alignment;
+
+    static size_t roundUp(size_t size) {
+        return (max(size, sizeof(FreeNode)) + alignment - 1) & ~(alignment - 1);
     }
+
+    void grow() {
+        blocks.push_back(static_cast<char*>(::operator new(blockSize)));
+        cursor = blocks.back();
+        remaining = blockSize;
+    }
+
+    size_t blockSize;
+    vector<char*> blocks;
+    char* cursor;
+    size_t remaining;
+    FreeNode* freeLists[sizeClasses];
+};
+
+// Standard allocator over an Arena, for node-based containers. It follows its
+// container on copy, move and swap, so containers sharing an arena can be
+// reassigned freely.
+template <typename T>
+struct ArenaAllocator {
+    typedef T value_type;
+    typedef true_type propagate_on_container_copy_assignment;
+    typedef true_type propagate_on_container_move_assignment;
+    typedef true_type propagate_on_container_swap;
+
+    explicit ArenaAllocator(Arena* arena) : arena(arena) {}
+
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U>& other) : arena(other.arena) {}
+
+    T* allocate(size_t count) { return static_cast<T*>(arena->allocate(count * sizeof(T))); }
+    void deallocate(T* memory, size_t count) { arena->deallocate(memory, count * sizeof(T)); }
+
+    Arena* arena;
+};
+
+template <typename T, typename U>
+bool operator==(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b) {
+    return a.arena == b.arena;
 }
 
-void ensureDataDirectoryExists() {
-    #ifdef _WIN32
-    _mkdir("data");
-    #else
-    mkdir("data", 0777);
-    #endif
+template <typename T, typename U>
+bool operator!=(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b) {
+    return a.arena != b.arena;
 }
 
 
-// Data Management
+// Product Search - case-insensitive name queries plus a price filter
+//
+// Substring queries of three or more characters only verify products sharing
+// the query's rarest trigram; prefix queries binary-search a sorted name index
+// and price ranges a sorted price index. Shorter substrings fall back to a linear scan
+// over the lowercased names.
 
-void loadUsers() {
-    ifstream in(userFile);
-    if (!in) return;
-    
-    User user;
-    while (in >> user.username >> user.password >> user.email) {
-        userMap[user.username] = user;
-    }
+enum ProductSort { SORT_BY_ID, SORT_BY_NAME, SORT_BY_PRICE };
+
+struct ProductQuery {
+    ProductQuery() : prefixOnly(false), minPrice(Money::fromCents(0)),
+                     maxPrice(Money::fromCents(numeric_limits<long long>::max())),
+                     inStockOnly(false), limit(50) {}
+
+    string text;        // Empty matches every product
+    bool prefixOnly;    // Match only at the start of the name
+    Money minPrice;
+    Money maxPrice;
+    bool inStockOnly;
+    size_t limit;       // 0 for no limit
+};
+
+string toLower(const string& text) {
+    string lower(text);
+    for (char& c : lower) c = tolower(static_cast<unsigned char>(c));
+    return lower;
 }
 
-void saveUsers() {
-    ofstream out(userFile);
-    if (!out) {
-        UI::printError("Error saving users!");
-        return;
+class ProductSearchIndex {
+public:
+    // Indexes products stored at slots firstSlot, firstSlot + 1, ... The sorted
+    // indexes are vectors: the batch is sorted on its own and merged in once,
+    // so bulk loads cost one sort rather than a tree insert per product.
+    void addBatch(size_t firstSlot, const Product* first, const Product* last) {
+        size_t oldSize = lowerNames.size();
+        uint32_t slot = firstSlot;
+        for (const Product* product = first; product != last; ++product, ++slot) {
+            string name = toLower(product->name);
+            for (size_t i = 0; i + 3 <= name.size(); i++) {
+                vector<uint32_t>& postings = trigrams[trigramKey(name, i)];
+                // A name repeating a trigram would otherwise list the slot twice
+                if (postings.empty() || postings.back() != slot) postings.push_back(slot);
+            }
+            lowerNames.push_back(name);
+            prices.push_back(product->price);
+        }
+
+        auto byName = [this](uint32_t a, uint32_t b) {
+            int order = lowerNames[a].compare(lowerNames[b]);
+            return order != 0 ? order < 0 : a < b;
+        };
+        auto byPrice = [this](uint32_t a, uint32_t b) {
+            return prices[a] != prices[b] ? prices[a] < prices[b] : a < b;
+        };
+        mergeBatch(nameOrder, oldSize, lowerNames.size(), byName);
+        mergeBatch(priceOrder, oldSize, prices.size(), byPrice);
     }
-    
-    for (const auto& pair : userMap) {
-        out << pair.second.username << '\t' 
-            << pair.second.password << '\t' 
-            << pair.second.email << '\n';
+
+    void clear() {
+        trigrams.clear();
+        nameOrder.clear();
+        priceOrder.clear();
+        lowerNames.clear();
+        prices.clear();
+    }
+
+    void reserve(size_t count) {
+        nameOrder.reserve(count);
+        priceOrder.reserve(count);
+        lowerNames.reserve(count);
+        prices.reserve(count);
+    }
+
+    // Passes the slot of every product matching the text and price filters to
+    // `accept` until it returns false. Prefix and price-only queries visit slots
+    // in name or price order, everything else in catalog order.
+    template <typename Accept>
+    void search(const ProductQuery& query, Accept accept) const {
+        string text = toLower(query.text);
+        auto priceMatches = [&](uint32_t slot) {
+            return prices[slot] >= query.minPrice && prices[slot] <= query.maxPrice;
+        };
+
+        if (!text.empty() && query.prefixOnly) {
+            auto it = lower_bound(nameOrder.begin(), nameOrder.end(), text, [this](uint32_t slot, const string& key) {
+                return lowerNames[slot] < key;
+            });
+            for (; it != nameOrder.end() && lowerNames[*it].compare(0, text.size(), text) == 0; ++it) {
+                if (priceMatches(*it) && !accept(*it)) return;
+            }
+            return;
+        }
+
+        if (text.size() >= 3) {
+            const vector<uint32_t>* rarest = NULL;
+            for (size_t i = 0; i + 3 <= text.size(); i++) {
+                auto it = trigrams.find(trigramKey(text, i));
+                if (it == trigrams.end()) return;
+                if (rarest == NULL || it->second.size() < rarest->size()) rarest = &it->second;
+            }
+            for (uint32_t slot : *rarest) {
+                if (lowerNames[slot].find(text) != string::npos && priceMatches(slot) && !accept(slot)) return;
+            }
+            return;
+        }
+
+        if (query.minPrice.cents > 0 || query.maxPrice.cents < numeric_limits<long long>::max()) {
+            auto it = lower_bound(priceOrder.begin(), priceOrder.end(), query.minPrice, [this](uint32_t slot, Money key) {
+                return prices[slot] < key;
+            });
+            for (; it != priceOrder.end() && prices[*it] <= query.maxPrice; ++it) {
+                if (lowerNames[*it].find(text) != string::npos && !accept(*it)) return;
+            }
+            return;
+        }
+
+        for (uint32_t slot = 0; slot < lowerNames.size(); slot++) {
+            if (lowerNames[slot].find(text) != string::npos && !accept(slot)) return;
+        }
+    }
+
+    // Slot at `position` in the requested order; catalog order doubles as id order
+    uint32_t slotAt(ProductSort sort, size_t position) const {
+        switch (sort) {
+            case SORT_BY_NAME: return nameOrder[position];
+            case SORT_BY_PRICE: return priceOrder[position];
+            default: return position;
+        }
+    }
+
+private:
+    // Adds slots [oldSize, newSize) to a sorted slot index. Small batches are
+    // inserted in place (a memmove of 4-byte slots), large ones sorted and merged.
+    template <typename Less>
+    static void mergeBatch(vector<uint32_t>& index, size_t oldSize, size_t newSize, Less less) {
+        if (newSize - oldSize <= 64) {
+            for (uint32_t slot = oldSize; slot < newSize; slot++) {
+                index.insert(upper_bound(index.begin(), index.end(), slot, less), slot);
+            }
+            return;
+        }
+        for (uint32_t slot = oldSize; slot < newSize; slot++) {
+            index.push_back(slot);
+        }
+        sort(index.begin() + oldSize, index.end(), less);
+        inplace_merge(index.begin(), index.begin() + oldSize, index.end(), less);
+    }
+
+    static uint32_t trigramKey(const string& text, size_t at) {
+        return (uint32_t)(unsigned char)text[at] << 16 |
+               (uint32_t)(unsigned char)text[at + 1] << 8 |
+               (uint32_t)(unsigned char)text[at + 2];
+    }
+
+    unordered_map<uint32_t, vector<uint32_t>> trigrams;  // Postings in ascending slot order
+    vector<uint32_t> nameOrder;    // Slots sorted by lowercased name
+    vector<uint32_t> priceOrder;   // Slots sorted by price
+    vector<string> lowerNames;
+    vector<Money> prices;
+};
+
+
+// Product Catalog - readers work on an immutable version, writers publish new ones
+//
+// A version holds the records and every index. Lookups, pages and searches
+// load the current version inside an epoch read guard and take no lock.
+// The catalog keeps two versions: the published one and a spare the writer
+// owns. Adding products appends the batch to the spare in place and publishes
+// it with one atomic store; the old version becomes the spare and gets the
+// same batch appended once no reader is left in it - right away if it is
+// already idle, otherwise at the next write, which by then rarely has to wait
+// (and sleeps rather than spins if it does). A write therefore costs twice its
+// own batch rather than a copy of the catalog, at the price of keeping the
+// records and indexes twice.
+//
+// Stock is not part of a version. Every version points at the same counters,
+// one atomic per product, so reservations from many sessions only contend on
+// the product they touch. Records handed out by the catalog are copies
+// carrying the live stock level.
+
+class ProductCatalog {
+public:
+    enum ReserveResult { RESERVED, NOT_FOUND, OUT_OF_STOCK };
+
+    ProductCatalog() : current(NULL), spare(NULL), spareEpoch(0) {
+        reset(make_shared<StockCounters>());
+    }
+    ProductCatalog(const ProductCatalog&) = delete;
+    ProductCatalog& operator=(const ProductCatalog&) = delete;
+
+    ~ProductCatalog() {
+        delete current.load();
+        delete spare;
+    }
+
+    bool findById(int id, Product& out) const {
+        EpochManager::ReadGuard guard(epochs);
+        const Version& version = *current.load();
+        auto it = version.idIndex.find(id);
+        if (it == version.idIndex.end()) return false;
+        out = version.copyOf(it->second);
+        return true;
+    }
+
+    bool findByName(const string& name, Product& out) const {
+        EpochManager::ReadGuard guard(epochs);
+        const Version& version = *current.load();
+        auto it = version.nameIndex.find(name);
+        if (it == version.nameIndex.end()) return false;
+        out = version.copyOf(it->second);
+        return true;
+    }
+
+    // Takes `quantity` units of stock or nothing; `out` receives the product on success
+    ReserveResult reserve(int id, int quantity, Product& out) {
+        EpochManager::ReadGuard guard(epochs);
+        const Version& version = *current.load();
+        auto it = version.idIndex.find(id);
+        if (it == version.idIndex.end()) return NOT_FOUND;
+
+        atomic<int>& counter = (*version.stock)[it->second];
+        int available = counter.load(memory_order_relaxed);
+        do {
+            if (available < quantity) return OUT_OF_STOCK;
+        } while (!counter.compare_exchange_weak(available, available - quantity,
+                                                memory_order_acq_rel, memory_order_relaxed));
+
+        out = version.records[it->second];
+        out.quantity = available - quantity;
+        return RESERVED;
+    }
+
+    void release(int id, int quantity) {
+        EpochManager::ReadGuard guard(epochs);
+        const Version& version = *current.load();
+        auto it = version.idIndex.find(id);
+        if (it != version.idIndex.end()) {
+            (*version.stock)[it->second].fetch_add(quantity, memory_order_acq_rel);
+        }
+    }
+
+    // Duplicate ids or names keep the first record indexed, like the old list walk did
+    void add(const Product& product) {
+        addBatch(&product, &product + 1);
+    }
+
+    // Appends many products as one new version
+    void addBatch(const Product* first, const Product* last) {
+        lock_guard<mutex> guard(writer);
+        Version* published = current.load();
+        levelSpare(*published);
+        for (const Product* product = first; product != last; ++product) {
+            spare->stock->push_back(product->quantity);
+        }
+        spare->append(first, last);
+        current.store(spare);
+        spare = published;
+        spareEpoch = epochs.unpublished();
+        if (epochs.idle(spareEpoch)) levelSpare(*current.load());
+    }
+
+    // Readers still in the old versions keep their records and stock until they leave
+    void clear() {
+        lock_guard<mutex> guard(writer);
+        Version* published = current.load();
+        Version* oldSpare = spare;
+        reset(make_shared<StockCounters>());
+        epochs.retire(published);
+        epochs.retire(oldSpare);
+    }
+
+    // Fills `rows` with up to `count` products starting at `offset` in `sort`
+    // order; the cost depends on the page size, not the catalog size
+    void page(ProductSort sort, size_t offset, size_t count, vector<Product>& rows) const {
+        EpochManager::ReadGuard guard(epochs);
+        const Version& version = *current.load();
+        rows.clear();
+        for (size_t position = offset; position < version.records.size() && rows.size() < count; position++) {
+            rows.push_back(version.copyOf(version.searchIndex.slotAt(sort, position)));
+        }
+    }
+
+    vector<Product> search(const ProductQuery& query) const {
+        EpochManager::ReadGuard guard(epochs);
+        const Version& version = *current.load();
+        vector<Product> results;
+        version.searchIndex.search(query, [&](size_t slot) {
+            Product product = version.copyOf(slot);
+            if (!query.inStockOnly || product.quantity > 0) results.push_back(product);
+            return query.limit == 0 || results.size() < query.limit;
+        });
+        return results;
+    }
+
+    // Consistent copy of every record, used by the writers of products.txt/.bin
+    vector<Product> snapshot() const {
+        EpochManager::ReadGuard guard(epochs);
+        const Version& version = *current.load();
+        vector<Product> copy(version.records);
+        for (size_t slot = 0; slot < copy.size(); slot++) {
+            copy[slot].quantity = (*version.stock)[slot].load(memory_order_acquire);
+        }
+        return copy;
+    }
+
+    bool empty() const { return size() == 0; }
+
+    size_t size() const {
+        EpochManager::ReadGuard guard(epochs);
+        return current.load()->records.size();
+    }
+
+private:
+    // One atomic counter per slot in fixed-size segments that never move, so
+    // the writer can append while readers of older versions keep counting
+    class StockCounters {
+    public:
+        StockCounters() : segments(), count(0) {}
+        StockCounters(const StockCounters&) = delete;
+        StockCounters& operator=(const StockCounters&) = delete;
+
+        ~StockCounters() {
+            for (atomic<int>* segment : segments) delete[] segment;
+        }
+
+        atomic<int>& operator[](size_t slot) const {
+            return segments[slot >> segmentBits][slot & (segmentSize - 1)];
+        }
+
+        // Writer only; readers see the counter once a version containing its slot is published
+        void push_back(int quantity) {
+            if (count >> segmentBits >= maxSegments) throw length_error("product catalog is full");
+            atomic<int>*& segment = segments[count >> segmentBits];
+            if (segment == NULL) segment = new atomic<int>[segmentSize];
+            segment[count & (segmentSize - 1)].store(quantity, memory_order_relaxed);
+            count++;
+        }
+
+    private:
+        static const size_t segmentBits = 12;
+        static const size_t segmentSize = size_t(1) << segmentBits;
+        static const size_t maxSegments = size_t(1) << 16;  // About 268 million products
+
+        atomic<int>* segments[maxSegments];
+        size_t count;
+    };
+
+    typedef unordered_map<int, size_t, hash<int>, equal_to<int>,
+                          ArenaAllocator<pair<const int, size_t>>> IdIndex;
+    typedef unordered_map<string, size_t, hash<string>, equal_to<string>,
+                          ArenaAllocator<pair<const string, size_t>>> NameIndex;
+
+    // Only changed while no reader can be in it; its index nodes live and die with it
+    struct Version {
+        explicit Version(const shared_ptr<StockCounters>& stock)
+            : stock(stock),
+              idIndex(0, hash<int>(), equal_to<int>(), IdIndex::allocator_type(&indexNodes)),
+              nameIndex(0, hash<string>(), equal_to<string>(), NameIndex::allocator_type(&indexNodes)) {}
+
+        // Indexes products whose stock counters already exist
+        void append(const Product* first, const Product* last) {
+            size_t firstSlot = records.size();
+            for (const Product* product = first; product != last; ++product) {
+                size_t slot = records.size();
+                records.push_back(*product);
+                idIndex.emplace(product->id, slot);
+                nameIndex.emplace(string(product->name), slot);
+            }
+            searchIndex.addBatch(firstSlot, first, last);
+        }
+
+        Product copyOf(size_t slot) const {
+            Product product = records[slot];
+            product.quantity = (*stock)[slot].load(memory_order_acquire);
+            return product;
+        }
+
+        vector<Product> records;  // quantity is only meaningful at load time, see stock
+        shared_ptr<StockCounters> stock;
+        Arena indexNodes;         // Declared before the indexes so it outlives them
+        IdIndex idIndex;
+        NameIndex nameIndex;
+        ProductSearchIndex searchIndex;
+    };
+
+    // Starts over with two empty versions; caller holds `writer` and retires the old ones
+    void reset(const shared_ptr<StockCounters>& stock) {
+        current.store(new Version(stock));
+        spare = new Version(stock);
+        spareEpoch = 0;
+    }
+
+    // Brings the spare level with `published`, the version that replaced it.
+    // Caller holds `writer`.
+    void levelSpare(const Version& published) {
+        size_t have = spare->records.size();
+        if (have == published.records.size()) return;
+        epochs.synchronize(spareEpoch);
+        const Product* records = published.records.data();
+        spare->append(records + have, records + published.records.size());
+    }
+
+    atomic<Version*> current;
+    mutex writer;         // One writer at a time builds the next version
+    Version* spare;       // Writer only: the previous version, level once no reader is left in it
+    uint64_t spareEpoch;  // When the spare was unpublished
+};
+
+
+// String Table - interns product names and usernames so the order indexes
+// hash and compare small dense integers instead of strings; each string is
+// stored once and its symbol never changes while the table lives
+
+class StringTable {
+public:
+    uint32_t intern(const char* text) {
+        auto it = symbols.find(text);
+        if (it != symbols.end()) return it->second;
+        uint32_t symbol = strings.size();
+        it = symbols.emplace(text, symbol).first;
+        strings.push_back(&it->first);  // Node keys never move
+        return symbol;
+    }
+
+    bool find(const string& text, uint32_t& symbol) const {
+        auto it = symbols.find(text);
+        if (it == symbols.end()) return false;
+        symbol = it->second;
+        return true;
+    }
+
+    const string& str(uint32_t symbol) const { return *strings[symbol]; }
+
+    size_t size() const { return strings.size(); }
+
+    void clear() {
+        strings.clear();
+        symbols.clear();
+    }
+
+private:
+    unordered_map<string, uint32_t> symbols;
+    vector<const string*> strings;
+};
+
+
+// Sales Analytics - aggregates are updated as orders are added and delivered,
+// so reports never rescan the order book. Order facts are also kept column by
+// column (amounts in cents) so ad-hoc scans are tight, branch-free loops the
+// compiler can vectorize.
+
+struct SalesTotals {
+    long long orders;
+    long long units;
+    long long pendingCents;
+    long long deliveredCents;
+
+    long long revenueCents() const { return pendingCents + deliveredCents; }
+};
+
+struct SalesRanking {
+    string key;  // product name or username
+    SalesTotals totals;
+};
+
+enum SalesStatusFilter { SALES_ANY, SALES_PENDING, SALES_DELIVERED };
+
+struct SalesQuery {
+    SalesQuery() : minCents(0), maxCents(numeric_limits<long long>::max()), status(SALES_ANY) {}
+
+    long long minCents;
+    long long maxCents;
+    SalesStatusFilter status;
+};
+
+class SalesAnalytics {
+public:
+    // `product` and `user` are StringTable symbols, which double as ranking indexes
+    void recordOrder(size_t slot, const Order& order, uint32_t product, uint32_t user) {
+        addRanking(productTotals, product, order.productName);
+        addRanking(userTotals, user, order.username);
+        long long cents = order.totalAmount.cents;
+        bool delivered = strcmp(order.status, "Delivered") == 0;
+
+        if (slot >= amountCents.size()) {
+            productColumn.resize(slot + 1);
+            userColumn.resize(slot + 1);
+            quantityColumn.resize(slot + 1);
+            amountCents.resize(slot + 1);
+            deliveredColumn.resize(slot + 1);
+        }
+        productColumn[slot] = product;
+        userColumn[slot] = user;
+        quantityColumn[slot] = order.quantity;
+        amountCents[slot] = cents;
+        deliveredColumn[slot] = delivered;
+
+        for (SalesTotals* totals : {&overall, &productTotals[product].totals, &userTotals[user].totals}) {
+            totals->orders++;
+            totals->units += order.quantity;
+            (delivered ? totals->deliveredCents : totals->pendingCents) += cents;
+        }
+    }
+
+    void recordStatus(size_t slot, bool delivered) {
+        if (deliveredColumn[slot] == delivered) return;
+        deliveredColumn[slot] = delivered;
+
+        long long cents = amountCents[slot];
+        for (SalesTotals* totals : {&overall, &productTotals[productColumn[slot]].totals,
+                                    &userTotals[userColumn[slot]].totals}) {
+            totals->pendingCents += delivered ? -cents : cents;
+            totals->deliveredCents += delivered ? cents : -cents;
+        }
+    }
+
+    const SalesTotals& totals() const { return overall; }
+
+    vector<SalesRanking> topProducts(size_t count) const { return top(productTotals, count); }
+    vector<SalesRanking> topCustomers(size_t count) const { return top(userTotals, count); }
+
+    // Aggregates every order matching the query in one pass over the columns
+    SalesTotals scan(const SalesQuery& query) const {
+        const long long wantPending = query.status != SALES_DELIVERED;
+        const long long wantDelivered = query.status != SALES_PENDING;
+        const long long minCents = query.minCents, maxCents = query.maxCents;
+        const long long* amounts = amountCents.data();
+        const int* quantities = quantityColumn.data();
+        const uint8_t* deliveredFlags = deliveredColumn.data();
+
+        long long orders = 0, units = 0, pendingCents = 0, deliveredCents = 0;
+        size_t count = amountCents.size();
+        for (size_t i = 0; i < count; i++) {
+            long long cents = amounts[i];
+            long long delivered = deliveredFlags[i];
+            long long wanted = delivered ? wantDelivered : wantPending;
+            long long match = (cents >= minCents) & (cents <= maxCents) & wanted;
+            orders += match;
+            units += match * quantities[i];
+            deliveredCents += match * delivered * cents;
+            pendingCents += match * (1 - delivered) * cents;
+        }
+        return SalesTotals{orders, units, pendingCents, deliveredCents};
+    }
+
+private:
+    static void addRanking(vector<SalesRanking>& rankings, uint32_t symbol, const char* name) {
+        if (symbol == rankings.size()) rankings.push_back(SalesRanking{name, SalesTotals()});
+    }
+
+    // Highest revenue first; a partial sort keeps this O(entries) for small counts
+    static vector<SalesRanking> top(const vector<SalesRanking>& rankings, size_t count) {
+        vector<const SalesRanking*> order;
+        order.reserve(rankings.size());
+        for (const SalesRanking& ranking : rankings) order.push_back(&ranking);
+        count = min(count, order.size());
+        partial_sort(order.begin(), order.begin() + count, order.end(),
+                     [](const SalesRanking* a, const SalesRanking* b) {
+                         if (a->totals.revenueCents() != b->totals.revenueCents()) {
+                             return a->totals.revenueCents() > b->totals.revenueCents();
+                         }
+                         return a->key < b->key;
+                     });
+        vector<SalesRanking> result;
+        for (size_t i = 0; i < count; i++) result.push_back(*order[i]);
+        return result;
+    }
+
+    SalesTotals overall = SalesTotals();
+    vector<SalesRanking> productTotals;
+    vector<SalesRanking> userTotals;
+
+    // One entry per order slot
+    vector<uint32_t> productColumn;
+    vector<uint32_t> userColumn;
+    vector<int> quantityColumn;
+    vector<long long> amountCents;
+    vector<uint8_t> deliveredColumn;
+};
+
+
+// Order Store - orders keep a stable slot; a fulfillment index replaces the
+// old priority queue and secondary indexes answer per-customer and per-status
+// queries without touching the rest of the order book
+
+class OrderStore {
+public:
+    // Highest Order::priority first, oldest first within a priority
+    struct FulfillmentOrder {
+        const vector<Order>* records;
+
+        bool operator()(size_t a, size_t b) const {
+            const Order& x = (*records)[a];
+            const Order& y = (*records)[b];
+            if (y < x) return true;
+            if (x < y) return false;
+            return a < b;
+        }
+    };
+    typedef set<size_t, FulfillmentOrder, ArenaAllocator<size_t>> SlotSet;
+
+    OrderStore()
+        : fulfillment(emptySlotSet()), idIndex(emptyIdIndex()), emptySlots(emptySlotSet()), nextId(1) {}
+    OrderStore(const OrderStore&) = delete;
+    OrderStore& operator=(const OrderStore&) = delete;
+
+    // An order with id 0 gets the next id; loaded orders keep theirs
+    size_t add(const Order& order) {
+        size_t slot = records.size();
+        records.push_back(order);
+        if (order.id == 0) {
+            records[slot].id = nextId++;
+        } else if (order.id >= nextId) {
+            nextId = order.id + 1;
+        }
+        idIndex[records[slot].id] = slot;
+        fulfillment.insert(slot);
+        uint32_t user = usernames.intern(order.username);
+        if (user >= userIndex.size()) userIndex.resize(user + 1);
+        userIndex[user].push_back(slot);
+        statusSlots(order.status).insert(slot);
+        sales.recordOrder(slot, order, productNames.intern(order.productName), user);
+        return slot;
+    }
+
+    void setStatus(size_t slot, const char* status) {
+        Order& order = records[slot];
+        statusSlots(order.status).erase(slot);
+        strcpy(order.status, status);
+        statusSlots(status).insert(slot);
+        sales.recordStatus(slot, strcmp(status, "Delivered") == 0);
+    }
+
+    const Order& at(size_t slot) const { return records[slot]; }
+
+    bool find(long long id, size_t& slot) const {
+        auto it = idIndex.find(id);
+        if (it == idIndex.end()) return false;
+        slot = it->second;
+        return true;
+    }
+
+    // Slots of every order in fulfillment order
+    const SlotSet& all() const { return fulfillment; }
+
+    // Slots in fulfillment order, empty for statuses never seen
+    const SlotSet& withStatus(const string& status) const {
+        auto it = statusIndex.find(status);
+        return it == statusIndex.end() ? emptySlots : it->second;
+    }
+
+    // Slots in the order the customer placed them
+    const vector<size_t>& forUser(const string& username) const {
+        static const vector<size_t> none;
+        uint32_t user;
+        return usernames.find(username, user) ? userIndex[user] : none;
+    }
+
+    // Records in slot order, which is also the snapshot file order
+    const vector<Order>& orders() const { return records; }
+
+    const SalesAnalytics& analytics() const { return sales; }
+
+    bool empty() const { return records.empty(); }
+    size_t size() const { return records.size(); }
+
+    void reserve(size_t count) {
+        records.reserve(count);
+    }
+
+    // The slot set nodes go back with their arena in one go
+    void clear() {
+        fulfillment.clear();
+        statusIndex.clear();
+        idIndex = emptyIdIndex();
+        slotNodes.release();
+        userIndex.clear();
+        usernames.clear();
+        productNames.clear();
+        records.clear();
+        nextId = 1;
+        sales = SalesAnalytics();
+    }
+
+private:
+    SlotSet& statusSlots(const string& status) {
+        auto it = statusIndex.find(status);
+        if (it == statusIndex.end()) {
+            it = statusIndex.emplace(status, emptySlotSet()).first;
+        }
+        return it->second;
+    }
+
+    typedef unordered_map<long long, size_t, hash<long long>, equal_to<long long>,
+                          ArenaAllocator<pair<const long long, size_t>>> IdIndex;
+
+    SlotSet emptySlotSet() {
+        return SlotSet(FulfillmentOrder{&records}, SlotSet::allocator_type(&slotNodes));
+    }
+
+    IdIndex emptyIdIndex() {
+        return IdIndex(0, hash<long long>(), equal_to<long long>(), IdIndex::allocator_type(&slotNodes));
+    }
+
+    vector<Order> records;
+    Arena slotNodes;  // Declared before the slot sets so it outlives them
+    SlotSet fulfillment;
+    IdIndex idIndex;
+    StringTable usernames;
+    StringTable productNames;
+    vector<vector<size_t>> userIndex;  // By username symbol
+    map<string, SlotSet> statusIndex;
+    const SlotSet emptySlots;
+    long long nextId;
+    SalesAnalytics sales;
+};
+
+
+// Global Variables
+
+OrderStore orderStore;
+mutex orderBookMutex;  // Guards orderStore, order journal appends and the ledger
+ProductCatalog catalog;
+map<string, User> userMap;
+int nextProductId = 1;
+int productPageSize = 20;       // Rows per page in the product browser
+int cartTimeoutSeconds = 1800;  // Idle carts give their stock back after this long
+int productFlushMilliseconds = 2000;  // Longest a product change waits before reaching disk
+int productFlushThreshold = 500;      // Pending product changes that force an early flush
+int fulfillmentWorkers = 0;             // Threads shipping pending orders; 0 leaves it to the admin
+int fulfillmentShipMilliseconds = 50;  // Simulated shipping time per order
+bool checksumFooters = true;  // Text data files end in a "#crc32" line the loaders verify
+int passwordIterations = 20000;   // PBKDF2 work factor for newly stored passwords
+int passwordHashThreads = 2;      // Workers that run password hashing off the session threads
+bool binarySnapshots = false;  // --binary: load and save data/*.bin instead of text
+bool metricsEnabled = false;   // --metrics: time the hot paths; set before any thread starts
+int metricsDumpSeconds = 60;   // How often data/metrics.prom is rewritten; 0 only writes it at exit
+
+
+// Utility Functions
+
+bool fileExists(const char* fileName) {
+    ifstream file(fileName);
+    return file.good();
+}
+
+// Cuts a log back to `size` bytes, e.g. to drop a record torn by a crash
+bool truncateFile(const char* fileName, long long size) {
+    #ifdef _WIN32
+    int fd = _open(fileName, _O_RDWR | _O_BINARY);
+    if (fd < 0) return false;
+    bool truncated = _chsize_s(fd, size) == 0;
+    _close(fd);
+    return truncated;
+    #else
+    return truncate(fileName, size) == 0;
+    #endif
+}
+
+bool containsAlphabet(const string& str) {
+    for (char c : str) {
+        if (isalpha(c)) return true;
+    }
+    return false;
+}
+
+bool containsDigits(const string& str) {
+    for (char c : str) {
+        if (isdigit(c)) return true;
+    }
+    return false;
+}
+
+bool emailValid(const string& email) {
+    return email.find('@') != string::npos && 
+           email.find('.') != string::npos;
+}
+
+bool usernameValid(const string& username) {
+    return !username.empty() && username.size() < 50 &&
+           username.find_first_of(" \t\r\n") == string::npos;
+}
+
+bool passwordValid(const string& password) {
+    return password.length() >= 6 && containsAlphabet(password) && containsDigits(password);
+}
+
+bool priceValid(const string& s) {
+    Money price;
+    return Money::parse(s, price);
+}
+
+bool quantityValid(const string& s) {
+    try {
+        stoi(s);
+        return true;
+    } catch (...) {
+        return false;
+    }
+}
+
+bool positiveAmountValid(const string& s) {
+    Money amount;
+    return Money::parse(s, amount) && amount.cents > 0;
+}
+
+// For text already checked by priceValid or positiveAmountValid
+Money toMoney(const string& s) {
+    Money amount = Money::fromCents(0);
+    Money::parse(s, amount);
+    return amount;
+}
+
+string getInput(const string& prompt, bool (*validator)(const string&) = nullptr, 
+               const string& errorMsg = "Invalid input!") {
+    string input;
+    while (true) {
+        cout << UI::BOLD << prompt << UI::RESET;
+        if (!getline(cin, input)) {
+            // Piped input ran out mid-prompt; the order journal covers anything unsaved
+            cout << endl;
+            UI::printInfo("Input closed, exiting.");
+            exit(0);
+        }
+        
+        if (validator == nullptr || validator(input)) {
+            return input;
+        }
+        UI::printError(errorMsg);
+    }
+}
+
+// Reads a menu number; end of input selects `exitChoice`, garbage reads as invalid
+int readMenuChoice(int exitChoice) {
+    int choice;
+    if (cin >> choice) {
+        cin.ignore();
+        return choice;
+    }
+    if (cin.eof()) return exitChoice;
+    cin.clear();
+    cin.ignore(numeric_limits<streamsize>::max(), '\n');
+    return -1;
+}
+
+void ensureDataDirectoryExists() {
+    #ifdef _WIN32
+    _mkdir("data");
+    #else
+    mkdir("data", 0777);
+    #endif
+}
+
+// Makes renames and new directory entries under `path`'s directory durable
+void syncParentDirectory(const char* path) {
+    #ifndef _WIN32
+    string directory(path);
+    size_t slash = directory.rfind('/');
+    directory = slash == string::npos ? "." : directory.substr(0, max<size_t>(slash, 1));
+    int fd = ::open(directory.c_str(), O_RDONLY);
+    if (fd < 0) return;
+    fsync(fd);
+    ::close(fd);
+    #else
+    (void)path;  // MOVEFILE_WRITE_THROUGH already waits for the rename to reach disk
+    #endif
+}
+
+bool replaceFile(const char* from, const char* to) {
+    #ifdef _WIN32
+    return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+    #else
+    if (rename(from, to) != 0) return false;
+    syncParentDirectory(to);
+    return true;
+    #endif
+}
+
+
+// Instrumentation - timers, counters and latency histograms for the hot paths
+//
+// Every thread records into its own buffer, so instrumented code never shares
+// a cache line or takes a lock; readers sum the buffers when a report or dump
+// is asked for. With metrics off a timer is a single branch on a flag that is
+// fixed at startup.
+
+enum Metric {
+    METRIC_LOAD_USERS,
+    METRIC_SAVE_USERS,
+    METRIC_LOAD_PRODUCTS,
+    METRIC_SAVE_PRODUCTS,
+    METRIC_LOAD_ORDERS,
+    METRIC_SAVE_ORDERS,
+    METRIC_ORDER_SNAPSHOT,
+    METRIC_LOGIN,
+    METRIC_ADD_TO_CART,
+    METRIC_CHECKOUT,
+    METRIC_ORDER_HISTORY,
+    METRIC_ORDER_LIST,
+    METRIC_MARK_DELIVERED,
+    METRIC_FULFILLMENT,
+    METRIC_HTTP_REQUEST,
+    METRIC_COUNT
+};
+
+enum Counter {
+    COUNTER_ORDERS_PLACED,
+    COUNTER_OUT_OF_STOCK,
+    COUNTER_EMPTY_CHECKOUTS,
+    COUNTER_FAILED_LOGINS,
+    COUNTER_CARTS_EXPIRED,
+    COUNTER_JOURNAL_RECORDS,
+    COUNTER_HTTP_ERRORS,
+    COUNTER_COUNT
+};
+
+const char* const metricNames[METRIC_COUNT] = {
+    "load_users", "save_users", "load_products", "save_products", "load_orders", "save_orders",
+    "order_snapshot", "login", "add_to_cart", "checkout", "order_history", "order_list",
+    "mark_delivered", "fulfillment", "http_request"
+};
+
+const char* const counterNames[COUNTER_COUNT] = {
+    "orders_placed", "out_of_stock", "empty_checkouts", "failed_logins", "carts_expired", "journal_records",
+    "http_errors"
+};
+
+// Bucket i counts calls shorter than 2^(i + 10) ns (about 1us, 2us, 4us, ...);
+// the last bucket takes everything slower
+const int metricBuckets = 24;
+
+inline uint64_t metricBucketBound(int bucket) {
+    return uint64_t(1) << (bucket + 10);
+}
+
+inline int metricBucket(uint64_t nanoseconds) {
+    int bits = 0;
+    for (uint64_t rest = nanoseconds >> 10; rest != 0; rest >>= 1) bits++;
+    return min(bits, metricBuckets - 1);
+}
+
+// One thread's numbers. Only the owning thread writes, so plain loads and
+// stores (no read-modify-write) are enough; atomics just keep readers defined.
+struct MetricsBuffer {
+    struct Timer {
+        atomic<uint64_t> buckets[metricBuckets];
+        atomic<uint64_t> count;
+        atomic<uint64_t> totalNanoseconds;
+        atomic<uint64_t> maxNanoseconds;
+    };
+
+    Timer timers[METRIC_COUNT];
+    atomic<uint64_t> counters[COUNTER_COUNT];
+
+    static void bump(atomic<uint64_t>& value, uint64_t amount) {
+        value.store(value.load(memory_order_relaxed) + amount, memory_order_relaxed);
+    }
+
+    void record(Metric metric, uint64_t nanoseconds) {
+        Timer& timer = timers[metric];
+        bump(timer.buckets[metricBucket(nanoseconds)], 1);
+        bump(timer.count, 1);
+        bump(timer.totalNanoseconds, nanoseconds);
+        if (nanoseconds > timer.maxNanoseconds.load(memory_order_relaxed)) {
+            timer.maxNanoseconds.store(nanoseconds, memory_order_relaxed);
+        }
+    }
+};
+
+struct TimerTotals {
+    uint64_t buckets[metricBuckets];
+    uint64_t count;
+    uint64_t totalNanoseconds;
+    uint64_t maxNanoseconds;
+
+    // Upper bound of the bucket holding the q-th quantile
+    uint64_t quantileNanoseconds(double q) const {
+        if (count == 0) return 0;
+        uint64_t rank = (uint64_t)ceil(q * count);
+        uint64_t seen = 0;
+        for (int i = 0; i < metricBuckets - 1; i++) {
+            seen += buckets[i];
+            if (seen >= rank) return min(metricBucketBound(i), maxNanoseconds);
+        }
+        return maxNanoseconds;
+    }
+};
+
+struct MetricsSnapshot {
+    TimerTotals timers[METRIC_COUNT];
+    uint64_t counters[COUNTER_COUNT];
+
+    void add(const MetricsBuffer& buffer) {
+        for (int m = 0; m < METRIC_COUNT; m++) {
+            const MetricsBuffer::Timer& from = buffer.timers[m];
+            TimerTotals& to = timers[m];
+            for (int i = 0; i < metricBuckets; i++) to.buckets[i] += from.buckets[i].load(memory_order_relaxed);
+            to.count += from.count.load(memory_order_relaxed);
+            to.totalNanoseconds += from.totalNanoseconds.load(memory_order_relaxed);
+            to.maxNanoseconds = max<uint64_t>(to.maxNanoseconds, from.maxNanoseconds.load(memory_order_relaxed));
+        }
+        for (int c = 0; c < COUNTER_COUNT; c++) counters[c] += buffer.counters[c].load(memory_order_relaxed);
+    }
+};
+
+class MetricsRegistry {
+public:
+    MetricsRegistry() : retired() {}
+
+    // The calling thread's buffer, created on first use
+    MetricsBuffer& local() {
+        thread_local Registration registration(*this);
+        return *registration.buffer;
+    }
+
+    MetricsSnapshot snapshot() {
+        lock_guard<mutex> guard(lock);
+        MetricsSnapshot totals = retired;
+        for (const MetricsBuffer* buffer : buffers) totals.add(*buffer);
+        return totals;
+    }
+
+private:
+    // Threads that exit fold their numbers into `retired`
+    struct Registration {
+        explicit Registration(MetricsRegistry& registry) : registry(registry), buffer(new MetricsBuffer()) {
+            lock_guard<mutex> guard(registry.lock);
+            registry.buffers.push_back(buffer);
+        }
+
+        ~Registration() {
+            lock_guard<mutex> guard(registry.lock);
+            registry.retired.add(*buffer);
+            registry.buffers.erase(find(registry.buffers.begin(), registry.buffers.end(), buffer));
+            delete buffer;
+        }
+
+        MetricsRegistry& registry;
+        MetricsBuffer* buffer;
+    };
+
+    mutex lock;
+    vector<MetricsBuffer*> buffers;
+    MetricsSnapshot retired;
+};
+
+MetricsRegistry metrics;
+
+inline void countMetric(Counter counter, uint64_t amount = 1) {
+    if (metricsEnabled) MetricsBuffer::bump(metrics.local().counters[counter], amount);
+}
+
+// Times the enclosing scope
+class MetricTimer {
+public:
+    explicit MetricTimer(Metric metric) : metric(metric), active(metricsEnabled) {
+        if (active) start = chrono::steady_clock::now();
+    }
+
+    ~MetricTimer() {
+        if (!active) return;
+        chrono::steady_clock::duration elapsed = chrono::steady_clock::now() - start;
+        metrics.local().record(metric, chrono::duration_cast<chrono::nanoseconds>(elapsed).count());
+    }
+
+    MetricTimer(const MetricTimer&) = delete;
+    MetricTimer& operator=(const MetricTimer&) = delete;
+
+private:
+    Metric metric;
+    bool active;
+    chrono::steady_clock::time_point start;
+};
+
+// Prometheus text exposition format
+string formatMetrics(const MetricsSnapshot& snapshot) {
+    ostringstream out;
+    out << setprecision(9);
+    for (int m = 0; m < METRIC_COUNT; m++) {
+        const TimerTotals& timer = snapshot.timers[m];
+        string name = string("ecommerce_") + metricNames[m] + "_seconds";
+        out << "# TYPE " << name << " histogram\n";
+        uint64_t cumulative = 0;
+        for (int i = 0; i < metricBuckets - 1; i++) {
+            cumulative += timer.buckets[i];
+            out << name << "_bucket{le=\"" << metricBucketBound(i) / 1e9 << "\"} " << cumulative << '\n';
+        }
+        out << name << "_bucket{le=\"+Inf\"} " << timer.count << '\n';
+        out << name << "_sum " << timer.totalNanoseconds / 1e9 << '\n';
+        out << name << "_count " << timer.count << '\n';
+    }
+    for (int c = 0; c < COUNTER_COUNT; c++) {
+        string name = string("ecommerce_") + counterNames[c] + "_total";
+        out << "# TYPE " << name << " counter\n" << name << ' ' << snapshot.counters[c] << '\n';
+    }
+    return out.str();
+}
+
+
+// Binary Snapshots - a header followed by the raw record array
+//
+// Product, User and Order are fixed-size records, so a snapshot is mapped and
+// its records are read in place. Files use the host byte order; recordSize and
+// version reject files written by a build with a different record layout.
+
+const char snapshotMagic[8] = {'E', 'C', 'O', 'M', 'S', 'N', 'A', 'P'};
+const uint32_t snapshotVersion = 5;  // 2: amounts are integer cents, 3: password hashes, 4: order ids,
+                                     // 5: product ids in orders
+
+enum SnapshotType : uint32_t {
+    USER_SNAPSHOT = 1,
+    PRODUCT_SNAPSHOT = 2,
+    ORDER_SNAPSHOT = 3
+};
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t recordType;
+    uint32_t recordSize;
+    uint32_t payloadChecksum;
+    uint64_t recordCount;
+    uint64_t lsn;            // Last order journal record folded in (orders only)
+    uint32_t reserved;
+    uint32_t headerChecksum; // Over the header with this field zeroed
+};
+
+uint32_t crc32(const void* data, size_t length, uint32_t crc = 0) {
+    static uint32_t table[256];
+    static bool tableReady = [] {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) {
+                c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            }
+            table[i] = c;
+        }
+        return true;
+    }();
+    (void)tableReady;
+
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    crc = ~crc;
+    for (size_t i = 0; i < length; i++) {
+        crc = table[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+uint32_t snapshotHeaderChecksum(SnapshotHeader header) {
+    header.headerChecksum = 0;
+    return crc32(&header, sizeof(header));
+}
+
+// Read-only view of a whole file, memory-mapped where the platform allows it
+class MappedFile {
+public:
+    MappedFile() : base(NULL), length(0) {}
+    ~MappedFile() { unmap(); }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool map(const char* fileName) {
+        unmap();
+        #ifdef _WIN32
+        ifstream in(fileName, ios::binary);
+        if (!in) return false;
+        buffer.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+        base = buffer.data();
+        length = buffer.size();
+        return true;
+        #else
+        int fd = ::open(fileName, O_RDONLY);
+        if (fd < 0) return false;
+        struct stat info;
+        if (fstat(fd, &info) != 0 || info.st_size == 0) {
+            ::close(fd);
+            return false;
+        }
+        void* mapped = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (mapped == MAP_FAILED) return false;
+        posix_madvise(mapped, info.st_size, POSIX_MADV_SEQUENTIAL);
+        base = static_cast<const char*>(mapped);
+        length = info.st_size;
+        return true;
+        #endif
+    }
+
+    void unmap() {
+        #ifdef _WIN32
+        buffer.clear();
+        #else
+        if (base != NULL) munmap(const_cast<char*>(base), length);
+        #endif
+        base = NULL;
+        length = 0;
+    }
+
+    const char* data() const { return base; }
+    size_t size() const { return length; }
+
+private:
+    const char* base;
+    size_t length;
+    #ifdef _WIN32
+    vector<char> buffer;
+    #endif
+};
+
+template <typename T>
+class SnapshotView {
+public:
+    // False when the file and its .bak copy are both missing, truncated, from
+    // another layout or corrupt
+    bool open(const char* fileName, SnapshotType type) {
+        if (openFile(fileName, type)) return true;
+        string backup = string(fileName) + ".bak";
+        if (!openFile(backup.c_str(), type)) return false;
+        UI::printWarning(string(fileName) + " is damaged, loaded " + backup);
+        return true;
+    }
+
+    const T* begin() const { return reinterpret_cast<const T*>(file.data() + sizeof(SnapshotHeader)); }
+    const T* end() const { return begin() + header.recordCount; }
+    size_t size() const { return header.recordCount; }
+    unsigned long long lsn() const { return header.lsn; }
+
+private:
+    bool openFile(const char* fileName, SnapshotType type) {
+        if (!file.map(fileName) || file.size() < sizeof(SnapshotHeader)) return false;
+        memcpy(&header, file.data(), sizeof(header));
+
+        if (memcmp(header.magic, snapshotMagic, sizeof(snapshotMagic)) != 0 ||
+            header.headerChecksum != snapshotHeaderChecksum(header) ||
+            header.version != snapshotVersion ||
+            header.recordType != type ||
+            header.recordSize != sizeof(T) ||
+            file.size() != sizeof(SnapshotHeader) + header.recordCount * sizeof(T)) {
+            return false;
+        }
+        return crc32(begin(), header.recordCount * sizeof(T)) == header.payloadChecksum;
+    }
+
+    MappedFile file;
+    SnapshotHeader header;
+};
+
+// Writes a replacement for a data file next to it and swaps it in only once
+// the new contents are on disk, so a crash leaves either the old or the new file
+class AtomicFileWriter {
+public:
+    enum Options {
+        KEEP_BACKUP = 1,      // The replaced version stays behind as <name>.bak
+        CHECKSUM_FOOTER = 2   // Appends a "#crc32" line when checksumFooters is on
+    };
+
+    explicit AtomicFileWriter(const char* fileName, unsigned options = 0)
+        : target(fileName), tempName(string(fileName) + ".tmp"), options(options),
+          ok(true), checksum(0), bytes(0) {
+        out = fopen(tempName.c_str(), "wb");
+        ok = out != NULL;
+    }
+
+    ~AtomicFileWriter() {
+        if (out != NULL) {
+            fclose(out);
+            remove(tempName.c_str());
+        }
+    }
+
+    AtomicFileWriter(const AtomicFileWriter&) = delete;
+    AtomicFileWriter& operator=(const AtomicFileWriter&) = delete;
+
+    void write(const void* data, size_t length) {
+        if (ok && length > 0) ok = fwrite(data, 1, length, out) == length;
+        if (options & CHECKSUM_FOOTER) {
+            checksum = crc32(data, length, checksum);
+            bytes += length;
+        }
+    }
+
+    void write(const string& data) { write(data.data(), data.size()); }
+
+    // Flushes, fsyncs and renames over the target (fsyncing the directory too);
+    // false leaves the target untouched
+    bool commit() {
+        if (out == NULL) return false;
+        if ((options & CHECKSUM_FOOTER) && checksumFooters) {
+            char footer[64];
+            int length = snprintf(footer, sizeof(footer), "#crc32\t%08x\t%llu\n", checksum, bytes);
+            ok = ok && fwrite(footer, 1, length, out) == (size_t)length;
+        }
+        ok = ok && fflush(out) == 0;
+        #ifdef _WIN32
+        ok = ok && _commit(_fileno(out)) == 0;
+        #else
+        ok = ok && fsync(fileno(out)) == 0;
+        #endif
+        ok = fclose(out) == 0 && ok;
+        out = NULL;
+        if (!ok) {
+            remove(tempName.c_str());
+            return false;
+        }
+        if (options & KEEP_BACKUP) {
+            string backup = target + ".bak";
+            #ifdef _WIN32
+            if (fileExists(target.c_str())) {
+                return ReplaceFileA(target.c_str(), tempName.c_str(), backup.c_str(), 0, NULL, NULL) != 0;
+            }
+            #else
+            // A hard link keeps the old version without a moment where the target is missing
+            remove(backup.c_str());
+            link(target.c_str(), backup.c_str());
+            #endif
+        }
+        return replaceFile(tempName.c_str(), target.c_str());
+    }
+
+private:
+    string target;
+    string tempName;
+    unsigned options;
+    FILE* out;
+    bool ok;
+    uint32_t checksum;
+    unsigned long long bytes;
+};
+
+// One sequential write to a temporary file, then renamed over the old snapshot
+bool writeSnapshotFile(const char* fileName, SnapshotType type, const void* records,
+                       size_t recordSize, size_t count, unsigned long long lsn = 0) {
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, snapshotMagic, sizeof(snapshotMagic));
+    header.version = snapshotVersion;
+    header.recordType = type;
+    header.recordSize = recordSize;
+    header.recordCount = count;
+    header.lsn = lsn;
+    header.payloadChecksum = crc32(records, recordSize * count);
+    header.headerChecksum = snapshotHeaderChecksum(header);
+
+    AtomicFileWriter out(fileName, AtomicFileWriter::KEEP_BACKUP);
+    out.write(&header, sizeof(header));
+    out.write(records, recordSize * count);
+    return out.commit();
+}
+
+// Reads a whole text data file and strips its checksum footer. False when the
+// file is missing or its footer does not match; files without a footer
+// (written before footers existed or with them turned off) are accepted.
+bool readVerifiedFile(const string& fileName, string& contents) {
+    ifstream in(fileName, ios::binary);
+    if (!in) return false;
+    contents.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+
+    size_t footer = contents.rfind("#crc32\t");
+    if (footer == string::npos || (footer > 0 && contents[footer - 1] != '\n')) return true;
+
+    unsigned int checksum = 0;
+    unsigned long long bytes = 0;
+    if (sscanf(contents.c_str() + footer, "#crc32\t%8x\t%llu", &checksum, &bytes) != 2 ||
+        bytes != footer || crc32(contents.data(), footer) != checksum) {
+        return false;
+    }
+    contents.resize(footer);
+    return true;
+}
+
+// Loads a text data file, falling back to the .bak copy AtomicFileWriter kept
+// when the file is damaged
+bool readDataFile(const char* fileName, string& contents) {
+    if (readVerifiedFile(fileName, contents)) return true;
+    contents.clear();
+    string backup = string(fileName) + ".bak";
+    if (!readVerifiedFile(backup, contents)) {
+        if (fileExists(fileName)) UI::printError(string(fileName) + " is damaged and has no usable backup!");
+        contents.clear();
+        return false;
+    }
+    UI::printWarning(string(fileName) + " is damaged, loaded " + backup);
+    return true;
+}
+
+
+// Order Journal - orders.txt is a snapshot, orders.log holds every change since
+//
+// Each record carries a log sequence number (LSN) and the snapshot header stores
+// the last LSN it contains, so records already folded into the snapshot are
+// skipped on replay even if the process died halfway through a compaction.
+
+class OrderJournal {
+public:
+    OrderJournal() : lsn(0), pendingRecords(0), busy(false), hasJob(false), stopping(false),
+                     lastCompaction(chrono::steady_clock::now()) {}
+
+    ~OrderJournal() { close(); }
+
+    // Loads the snapshot and replays the journal tail on top of it
+    void recover(vector<Order>& orders) {
+        unsigned long long snapshotLsn = 0;
+        SnapshotView<Order> view;
+        string contents;
+        bool textLoaded = false;
+        if (binarySnapshots && view.open(ordersBinFile, ORDER_SNAPSHOT)) {
+            orders.assign(view.begin(), view.end());
+            snapshotLsn = view.lsn();
+        } else {
+            if (binarySnapshots && fileExists(ordersBinFile)) {
+                UI::printWarning("Ignoring damaged orders.bin, loading orders.txt");
+            }
+            textLoaded = readDataFile(ordersFile, contents);
+        }
+        if (textLoaded) {
+            istringstream in(contents);
+            if (in.peek() == '#') {
+                string tag;
+                in >> tag >> snapshotLsn;
+            }
+            string line;
+            while (getline(in, line)) {
+                Order order = Order();
+                if (parseOrder(line, order)) orders.push_back(order);
+            }
+        }
+
+        lsn = snapshotLsn;
+        RecoveryState state;
+        for (size_t i = 0; i < orders.size(); i++) {
+            state.track(orders, i);
+        }
+        replay(ordersCompactingLogFile, snapshotLsn, orders, state);
+        replay(ordersLogFile, snapshotLsn, orders, state);
+    }
+
+    void open() {
+        log.open(ordersLogFile, ios::app);
+        if (!log) {
+            UI::printError("Error opening order journal!");
+        }
+        worker = thread(&OrderJournal::workerLoop, this);
+    }
+
+    // One write for the whole batch, so a checkout reaches the log together
+    void appendOrders(const vector<Order>& orders) {
+        if (!log.is_open()) return;
+        for (const Order& order : orders) {
+            log << "N\t" << ++lsn << '\t' << order.id << '\t' << order.username << '\t'
+                << order.productId << '\t' << order.productName << '\t'
+                << order.quantity << '\t' << order.totalAmount << '\t'
+                << order.status << '\t' << order.priority << '\n';
+        }
+        log.flush();
+        pendingRecords += orders.size();
+        countMetric(COUNTER_JOURNAL_RECORDS, orders.size());
+    }
+
+    // One order changed status; replay finds it by id
+    void appendStatus(long long id, const char* status) {
+        if (!log.is_open()) return;
+        log << "S\t" << ++lsn << '\t' << id << '\t' << status << '\n';
+        log.flush();
+        pendingRecords++;
+        countMetric(COUNTER_JOURNAL_RECORDS);
+    }
+
+    bool hasPendingRecords() const {
+        return pendingRecords > 0 || fileExists(ordersCompactingLogFile);
+    }
+
+    bool compactionDue() const {
+        if (pendingRecords >= orderCompactionRecords) return true;
+        return pendingRecords > 0 &&
+               chrono::steady_clock::now() - lastCompaction >= chrono::seconds(orderCompactionSeconds);
+    }
+
+    // Rotates the log and writes `orders` out as the new snapshot. The caller's
+    // copy is handed to the worker thread when running in the background.
+    void compact(vector<Order> orders, bool background) {
+        unique_lock<mutex> lock(mtx);
+        changed.wait(lock, [this] { return !busy; });
+        pendingRecords = 0;
+        lastCompaction = chrono::steady_clock::now();
+
+        // A rotated log left behind by a crash must be folded in before the
+        // current log may be rotated over it
+        if (fileExists(ordersCompactingLogFile)) {
+            writeSnapshot(orders, lsn);
+            if (log.is_open()) {
+                log.close();
+                log.open(ordersLogFile, ios::trunc);
+            }
+            return;
+        }
+
+        if (log.is_open()) {
+            log.close();
+            replaceFile(ordersLogFile, ordersCompactingLogFile);
+            log.open(ordersLogFile, ios::trunc);
+        }
+
+        if (background && worker.joinable()) {
+            jobOrders.swap(orders);
+            jobLsn = lsn;
+            busy = true;
+            hasJob = true;
+            changed.notify_all();
+        } else {
+            lock.unlock();
+            writeSnapshot(orders, lsn);
+        }
+    }
+
+    // Waits for an in-flight compaction and stops the worker
+    void close() {
+        {
+            lock_guard<mutex> lock(mtx);
+            stopping = true;
+            changed.notify_all();
+        }
+        if (worker.joinable()) worker.join();
+        if (log.is_open()) log.close();
+    }
+
+private:
+    // Orders written before ids existed are numbered in file order, which
+    // every restart reproduces until the next snapshot stores the ids
+    struct RecoveryState {
+        RecoveryState() : nextId(1) {}
+
+        void track(vector<Order>& orders, size_t index) {
+            Order& order = orders[index];
+            if (order.id == 0) order.id = nextId;
+            if (order.id >= nextId) nextId = order.id + 1;
+            slotById[order.id] = index;
+            if (strcmp(order.status, "Pending") == 0) {
+                pendingByUser[order.username].push_back(index);
+            }
+        }
+
+        long long nextId;
+        unordered_map<long long, size_t> slotById;
+        unordered_map<string, vector<size_t>> pendingByUser;  // For "D" records from older logs
+    };
+
+    // "id user productId product quantity total status priority"; older files
+    // lack the product id, and before that the order id too
+    static bool parseOrder(const string& line, Order& order) {
+        istringstream fields(line);
+        size_t count = 0;
+        string token;
+        while (fields >> token) count++;
+        if (count < 6 || count > 8) return false;
+
+        istringstream in(line);
+        if (count >= 7 && !(in >> order.id)) return false;
+        if (!(in >> order.username)) return false;
+        if (count == 8 && !(in >> order.productId)) return false;
+        return static_cast<bool>(in >> order.productName >> order.quantity >> order.totalAmount
+                                    >> order.status >> order.priority);
+    }
+
+    // Anything after the last complete record was torn by a crash mid-append
+    // and is cut off, so the next record is not glued onto it and lost
+    void replay(const char* fileName, unsigned long long snapshotLsn, vector<Order>& orders,
+                RecoveryState& state) {
+        ifstream in(fileName, ios::binary);
+        if (!in) return;
+
+        long long complete = 0;  // Offset just past the last complete line
+        bool torn = false;
+        size_t skipped = 0;
+        string line;
+        while (getline(in, line)) {
+            if (in.eof()) {
+                torn = true;
+                break;
+            }
+            complete = in.tellg();
+            // A damaged line in the middle is skipped; the records after it still count
+            if (!applyRecord(line, snapshotLsn, orders, state)) skipped++;
+        }
+        in.close();
+
+        if (skipped > 0) {
+            UI::printWarning(string("Skipped ") + to_string(skipped) + " unreadable record(s) in " + fileName);
+        }
+        if (torn) {
+            UI::printWarning(string("Dropping a torn record at the end of ") + fileName);
+            if (!truncateFile(fileName, complete)) {
+                UI::printError(string("Error truncating ") + fileName + "!");
+            }
+        }
+    }
+
+    // False when the record cannot be parsed
+    bool applyRecord(const string& line, unsigned long long snapshotLsn, vector<Order>& orders,
+                     RecoveryState& state) {
+        istringstream record(line);
+        string type;
+        unsigned long long recordLsn;
+        if (!(record >> type >> recordLsn)) return false;
+
+        if (type == "N") {
+            Order order = Order();
+            string rest;
+            getline(record, rest);
+            if (!parseOrder(rest, order)) return false;
+            if (recordLsn <= snapshotLsn) return true;
+            orders.push_back(order);
+            state.track(orders, orders.size() - 1);
+        } else if (type == "S") {
+            long long id;
+            string status;
+            if (!(record >> id >> status)) return false;
+            if (recordLsn <= snapshotLsn) return true;
+            auto it = state.slotById.find(id);
+            if (it != state.slotById.end() && status.size() < sizeof(Order().status)) {
+                strcpy(orders[it->second].status, status.c_str());
+            }
+        } else if (type == "F") {
+            size_t slot;
+            if (!(record >> slot)) return false;
+            if (recordLsn <= snapshotLsn) return true;
+            if (slot < orders.size()) strcpy(orders[slot].status, "Delivered");
+        } else if (type == "D") {
+            string username;
+            if (!(record >> username)) return false;
+            if (recordLsn <= snapshotLsn) return true;
+            auto it = state.pendingByUser.find(username);
+            if (it != state.pendingByUser.end()) {
+                for (size_t index : it->second) {
+                    strcpy(orders[index].status, "Delivered");
+                }
+                state.pendingByUser.erase(it);
+            }
+        } else {
+            return false;
+        }
+        if (recordLsn > lsn) lsn = recordLsn;
+        return true;
+    }
+
+    // Orders are written in slot order so reloading reproduces the same slots
+    void writeSnapshot(const vector<Order>& orders, unsigned long long snapshotLsn) {
+        MetricTimer timer(METRIC_ORDER_SNAPSHOT);
+        if (binarySnapshots) {
+            if (!writeSnapshotFile(ordersBinFile, ORDER_SNAPSHOT, orders.data(), sizeof(Order),
+                                   orders.size(), snapshotLsn)) {
+                UI::printError("Error saving orders!");
+                return;
+            }
+            remove(ordersCompactingLogFile);
+            return;
+        }
+
+        ostringstream out;
+        out << "#lsn\t" << snapshotLsn << '\n';
+        for (const Order& order : orders) {
+            out << order.id << '\t' << order.username << '\t' << order.productId << '\t' << order.productName << '\t'
+               << order.quantity << '\t' << order.totalAmount << '\t'
+               << order.status << '\t' << order.priority << '\n';
+        }
+
+        AtomicFileWriter file(ordersFile, AtomicFileWriter::KEEP_BACKUP | AtomicFileWriter::CHECKSUM_FOOTER);
+        file.write(out.str());
+        if (!file.commit()) {
+            UI::printError("Error saving orders!");
+            return;
+        }
+        remove(ordersCompactingLogFile);
+    }
+
+    void workerLoop() {
+        unique_lock<mutex> lock(mtx);
+        while (true) {
+            changed.wait(lock, [this] { return hasJob || stopping; });
+            if (hasJob) {
+                vector<Order> orders;
+                orders.swap(jobOrders);
+                unsigned long long snapshotLsn = jobLsn;
+                hasJob = false;
+
+                lock.unlock();
+                writeSnapshot(orders, snapshotLsn);
+                lock.lock();
+
+                busy = false;
+                changed.notify_all();
+            } else {
+                return;
+            }
+        }
+    }
+
+    ofstream log;
+    unsigned long long lsn;
+    int pendingRecords;
+
+    thread worker;
+    mutex mtx;
+    condition_variable changed;
+    bool busy;
+    bool hasJob;
+    bool stopping;
+    vector<Order> jobOrders;
+    unsigned long long jobLsn;
+    chrono::steady_clock::time_point lastCompaction;
+};
+
+OrderJournal orderJournal;
+
+
+// Ledger - every change to the site balance is one appended line in
+// data/ledger.log, so the balance is an exact integer sum of the file and no
+// longer has to be rebuilt from delivered orders at startup.
+//
+// Lines are "<kind>\t<cents>\t<memo>"; a final line without its newline was
+// torn by a crash and is cut off before new lines are appended.
+
+enum LedgerKind { LEDGER_OPENING, LEDGER_DEPOSIT, LEDGER_WITHDRAWAL, LEDGER_CREDIT, LEDGER_KINDS };
+
+class Ledger {
+public:
+    Ledger() : entries(0), tornTail(false), complete(0) {
+        for (long long& total : totals) total = 0;
+    }
+
+    // Sums the ledger file; false when there is no ledger yet
+    bool load() {
+        ifstream in(ledgerFile, ios::binary);
+        if (!in) return false;
+
+        string line;
+        while (getline(in, line)) {
+            if (in.eof()) {
+                tornTail = true;
+                break;
+            }
+            complete = in.tellg();
+            int kind = line.empty() ? -1 : kindOf(line[0]);
+            char* end = NULL;
+            long long cents = line.size() > 2 ? strtoll(line.c_str() + 2, &end, 10) : 0;
+            if (kind < 0 || end == NULL || *end != '\t') continue;
+            totals[kind] += cents;
+            entries++;
+        }
+        return true;
+    }
+
+    // A new ledger starts with the opening balance carried over from older data
+    void open(Money openingBalance) {
+        bool fresh = !fileExists(ledgerFile);
+        if (tornTail && !truncateFile(ledgerFile, complete)) {
+            UI::printError("Error truncating ledger!");
+        }
+        log.open(ledgerFile, ios::app);
+        if (!log) {
+            UI::printError("Error opening ledger!");
+            return;
+        }
+        if (fresh && openingBalance.cents != 0) {
+            append(LEDGER_OPENING, openingBalance, "opening");
+        }
+    }
+
+    void append(LedgerKind kind, Money amount, const string& memo = "-") {
+        totals[kind] += amount.cents;
+        entries++;
+        if (!log.is_open()) return;
+        log << kindCodes[kind] << '\t' << amount.cents << '\t' << memo << '\n';
+        log.flush();
+    }
+
+    Money balance() const {
+        return Money::fromCents(totals[LEDGER_OPENING] + totals[LEDGER_DEPOSIT] + totals[LEDGER_CREDIT] -
+                                totals[LEDGER_WITHDRAWAL]);
+    }
+
+    Money total(LedgerKind kind) const { return Money::fromCents(totals[kind]); }
+    long long size() const { return entries; }
+
+    void close() {
+        if (log.is_open()) log.close();
+    }
+
+private:
+    static int kindOf(char code) {
+        const char* found = strchr(kindCodes, code);
+        return code != '\0' && found != NULL ? found - kindCodes : -1;
+    }
+
+    static const char kindCodes[LEDGER_KINDS + 1];
+
+    ofstream log;
+    long long totals[LEDGER_KINDS];
+    long long entries;
+    bool tornTail;
+    long long complete;  // Offset just past the last complete line
+};
+
+const char Ledger::kindCodes[LEDGER_KINDS + 1] = "ODWC";
+
+Ledger ledger;  // Guarded by orderBookMutex
+
+
+// Password Hashing - passwords are stored as salted PBKDF2-HMAC-SHA256
+//
+// The encoded form is "pbkdf2$<iterations>$<salt hex>$<hash hex>", so the work
+// factor can be raised in data/config.txt and older hashes still verify. Stored
+// values without the prefix are legacy plaintext and are rehashed on login.
+
+class Sha256 {
+public:
+    Sha256() : length(0), buffered(0) {
+        static const uint32_t initial[8] = {
+            0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+        };
+        memcpy(state, initial, sizeof(state));
+    }
+
+    void update(const uint8_t* data, size_t size) {
+        length += size;
+        while (size > 0) {
+            size_t take = min(size, sizeof(block) - buffered);
+            memcpy(block + buffered, data, take);
+            buffered += take;
+            data += take;
+            size -= take;
+            if (buffered == sizeof(block)) {
+                compress(block);
+                buffered = 0;
+            }
+        }
+    }
+
+    void finish(uint8_t digest[32]) {
+        uint64_t bits = length * 8;
+        uint8_t padding[72] = {0x80};
+        size_t padLength = (buffered < 56 ? 56 : 120) - buffered;
+        for (int i = 0; i < 8; i++) padding[padLength + i] = uint8_t(bits >> (56 - 8 * i));
+        update(padding, padLength + 8);
+        for (int i = 0; i < 8; i++) {
+            for (int j = 0; j < 4; j++) digest[4 * i + j] = uint8_t(state[i] >> (24 - 8 * j));
+        }
+    }
+
+private:
+    static uint32_t rotate(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+    void compress(const uint8_t* chunk) {
+        static const uint32_t k[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+        };
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++) {
+            w[i] = uint32_t(chunk[4 * i]) << 24 | uint32_t(chunk[4 * i + 1]) << 16 |
+                   uint32_t(chunk[4 * i + 2]) << 8 | chunk[4 * i + 3];
+        }
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = rotate(w[i - 15], 7) ^ rotate(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotate(w[i - 2], 17) ^ rotate(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; i++) {
+            uint32_t t1 = h + (rotate(e, 6) ^ rotate(e, 11) ^ rotate(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+            uint32_t t2 = (rotate(a, 2) ^ rotate(a, 13) ^ rotate(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+    }
+
+    uint32_t state[8];
+    uint64_t length;
+    uint8_t block[64];
+    size_t buffered;
+};
+
+// HMAC-SHA256 with the padded key absorbed once, so every PBKDF2 round costs
+// two compressions instead of four
+class HmacSha256 {
+public:
+    explicit HmacSha256(const string& key) {
+        uint8_t padded[64] = {0};
+        if (key.size() > sizeof(padded)) {
+            Sha256 keyHash;
+            keyHash.update(reinterpret_cast<const uint8_t*>(key.data()), key.size());
+            keyHash.finish(padded);
+        } else {
+            memcpy(padded, key.data(), key.size());
+        }
+        uint8_t innerPad[64], outerPad[64];
+        for (int i = 0; i < 64; i++) {
+            innerPad[i] = padded[i] ^ 0x36;
+            outerPad[i] = padded[i] ^ 0x5c;
+        }
+        inner.update(innerPad, sizeof(innerPad));
+        outer.update(outerPad, sizeof(outerPad));
+    }
+
+    void mac(const uint8_t* data, size_t size, uint8_t digest[32]) const {
+        Sha256 innerHash = inner;
+        innerHash.update(data, size);
+        innerHash.finish(digest);
+        Sha256 outerHash = outer;
+        outerHash.update(digest, 32);
+        outerHash.finish(digest);
+    }
+
+private:
+    Sha256 inner;
+    Sha256 outer;
+};
+
+// PBKDF2-HMAC-SHA256 with a single 32-byte output block
+void pbkdf2Sha256(const string& password, const string& salt, int iterations, uint8_t derived[32]) {
+    HmacSha256 hmac(password);
+    string first = salt + string("\0\0\0\1", 4);
+    uint8_t block[32];
+    hmac.mac(reinterpret_cast<const uint8_t*>(first.data()), first.size(), block);
+    memcpy(derived, block, sizeof(block));
+    for (int i = 1; i < iterations; i++) {
+        hmac.mac(block, sizeof(block), block);
+        for (int j = 0; j < 32; j++) derived[j] ^= block[j];
+    }
+}
+
+string toHex(const uint8_t* data, size_t size) {
+    static const char digits[] = "0123456789abcdef";
+    string hex;
+    for (size_t i = 0; i < size; i++) {
+        hex += digits[data[i] >> 4];
+        hex += digits[data[i] & 15];
+    }
+    return hex;
+}
+
+string fromHex(const string& hex) {
+    auto nibble = [](char c) { return isdigit(c) ? c - '0' : (tolower(c) - 'a' + 10) & 15; };
+    string bytes;
+    for (size_t i = 0; i + 1 < hex.size(); i += 2) {
+        bytes += char(nibble(hex[i]) << 4 | nibble(hex[i + 1]));
+    }
+    return bytes;
+}
+
+string hashPassword(const string& password, int iterations) {
+    static mutex rngMutex;
+    static random_device device;
+    uint8_t salt[16];
+    {
+        lock_guard<mutex> guard(rngMutex);
+        for (uint8_t& byte : salt) byte = uint8_t(device());
+    }
+    uint8_t derived[32];
+    pbkdf2Sha256(password, string(reinterpret_cast<char*>(salt), sizeof(salt)), iterations, derived);
+    return "pbkdf2$" + to_string(iterations) + "$" + toHex(salt, sizeof(salt)) + "$" + toHex(derived, sizeof(derived));
+}
+
+bool isPasswordHash(const string& stored) {
+    return stored.compare(0, 7, "pbkdf2$") == 0;
+}
+
+// Iterations recorded in a stored hash, 0 for legacy plaintext
+int passwordHashIterations(const string& stored) {
+    return isPasswordHash(stored) ? atoi(stored.c_str() + 7) : 0;
+}
+
+bool verifyPassword(const string& password, const string& stored) {
+    if (!isPasswordHash(stored)) return password == stored;
+
+    size_t saltStart = stored.find('$', 7);
+    size_t hashStart = saltStart == string::npos ? string::npos : stored.find('$', saltStart + 1);
+    int iterations = passwordHashIterations(stored);
+    if (hashStart == string::npos || iterations <= 0) return false;
+
+    uint8_t derived[32];
+    pbkdf2Sha256(password, fromHex(stored.substr(saltStart + 1, hashStart - saltStart - 1)), iterations, derived);
+    string expected = stored.substr(hashStart + 1);
+    string actual = toHex(derived, sizeof(derived));
+    if (expected.size() != actual.size()) return false;
+
+    unsigned char difference = 0;  // Compare every byte so timing reveals nothing
+    for (size_t i = 0; i < actual.size(); i++) difference |= expected[i] ^ actual[i];
+    return difference == 0;
+}
+
+// Runs hashing jobs on a few dedicated threads. Callers wait on the returned
+// future without holding any store lock, and the pool size caps how many
+// cores a burst of logins can take from everyone else.
+class PasswordHasher {
+public:
+    PasswordHasher() : stopping(false) {}
+    ~PasswordHasher() { stop(); }
+
+    future<string> hash(const string& password) {
+        int iterations = passwordIterations;
+        return submit<string>([password, iterations] { return hashPassword(password, iterations); });
+    }
+
+    future<bool> verify(const string& password, const string& stored) {
+        return submit<bool>([password, stored] { return verifyPassword(password, stored); });
+    }
+
+    void stop() {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+            wake.notify_all();
+        }
+        for (thread& worker : workers) worker.join();
+        workers.clear();
+    }
+
+private:
+    template <typename T>
+    future<T> submit(function<T()> work) {
+        shared_ptr<packaged_task<T()>> task = make_shared<packaged_task<T()>>(work);
+        future<T> result = task->get_future();
+        lock_guard<mutex> guard(lock);
+        if (stopping) {
+            (*task)();  // Shutting down: no workers left to hand it to
+            return result;
+        }
+        if (workers.empty()) {
+            for (int i = 0; i < max(passwordHashThreads, 1); i++) {
+                workers.emplace_back(&PasswordHasher::workerLoop, this);
+            }
+        }
+        jobs.push_back([task] { (*task)(); });
+        wake.notify_one();
+        return result;
+    }
+
+    void workerLoop() {
+        unique_lock<mutex> guard(lock);
+        while (true) {
+            wake.wait(guard, [this] { return stopping || !jobs.empty(); });
+            if (jobs.empty()) return;
+            function<void()> job = move(jobs.front());
+            jobs.pop_front();
+            guard.unlock();
+            job();
+            guard.lock();
+        }
+    }
+
+    mutex lock;
+    condition_variable wake;
+    deque<function<void()>> jobs;
+    vector<thread> workers;
+    bool stopping;
+};
+
+PasswordHasher passwordHasher;
+
+
+// Data Management
+
+void loadUsers() {
+    MetricTimer timer(METRIC_LOAD_USERS);
+    SnapshotView<User> view;
+    if (binarySnapshots && view.open(usersBinFile, USER_SNAPSHOT)) {
+        for (const User& user : view) {
+            userMap[user.username] = user;
+        }
+        return;
+    }
+    if (binarySnapshots && fileExists(usersBinFile)) {
+        UI::printWarning("Ignoring damaged users.bin, loading users.txt");
+    }
+
+    string contents;
+    if (!readDataFile(userFile, contents)) return;
+    istringstream in(contents);
+    
+    User user = User();
+    while (in >> user.username >> user.password >> user.email) {
+        userMap[user.username] = user;
+    }
+}
+
+void saveUsers() {
+    MetricTimer timer(METRIC_SAVE_USERS);
+    if (binarySnapshots) {
+        vector<User> users;
+        users.reserve(userMap.size());
+        for (const auto& pair : userMap) {
+            users.push_back(pair.second);
+        }
+        if (!writeSnapshotFile(usersBinFile, USER_SNAPSHOT, users.data(), sizeof(User), users.size())) {
+            UI::printError("Error saving users!");
+        }
+        return;
+    }
+
+    ostringstream out;
+    for (const auto& pair : userMap) {
+        out << pair.second.username << '\t' 
+            << pair.second.password << '\t' 
+            << pair.second.email << '\n';
+    }
+
+    AtomicFileWriter file(userFile, AtomicFileWriter::KEEP_BACKUP | AtomicFileWriter::CHECKSUM_FOOTER);
+    file.write(out.str());
+    if (!file.commit()) {
+        UI::printError("Error saving users!");
+    }
+}
+
+void addProductsToCatalog(const Product* first, const Product* last) {
+    catalog.addBatch(first, last);
+    
+    for (const Product* product = first; product != last; ++product) {
+        if (product->id >= nextProductId) {
+            nextProductId = product->id + 1;
+        }
+    }
+}
+
+void addProductToCatalog(const Product& product) {
+    addProductsToCatalog(&product, &product + 1);
+}
+
+void loadProducts() {
+    MetricTimer timer(METRIC_LOAD_PRODUCTS);
+    SnapshotView<Product> view;
+    if (binarySnapshots && view.open(productsBinFile, PRODUCT_SNAPSHOT)) {
+        catalog.clear();
+        addProductsToCatalog(view.begin(), view.end());
+        return;
+    }
+    if (binarySnapshots && fileExists(productsBinFile)) {
+        UI::printWarning("Ignoring damaged products.bin, loading products.txt");
+    }
+
+    string contents;
+    if (!readDataFile(productsFile, contents)) return;
+    istringstream in(contents);
+    
+    catalog.clear();
+
+    vector<Product> products;
+    Product temp = Product();
+    while (in >> temp.id >> temp.name >> temp.price >> temp.quantity) {
+        products.push_back(temp);
+    }
+    addProductsToCatalog(products.data(), products.data() + products.size());
+}
+
+// Writes the whole catalog durably; normally reached through productPersistence
+void saveProducts() {
+    static mutex fileLock;
+    lock_guard<mutex> guard(fileLock);
+    MetricTimer timer(METRIC_SAVE_PRODUCTS);
+
+    vector<Product> products = catalog.snapshot();
+    if (binarySnapshots) {
+        if (!writeSnapshotFile(productsBinFile, PRODUCT_SNAPSHOT, products.data(), sizeof(Product),
+                               products.size())) {
+            UI::printError("Error saving products!");
+        }
+        return;
+    }
+
+    ostringstream out;
+    for (const Product& product : products) {
+        out << product.id << '\t' 
+            << product.name << '\t' 
+            << product.price << '\t' 
+            << product.quantity << '\n';
+    }
+
+    AtomicFileWriter file(productsFile, AtomicFileWriter::KEEP_BACKUP | AtomicFileWriter::CHECKSUM_FOOTER);
+    file.write(out.str());
+    if (!file.commit()) {
+        UI::printError("Error saving products!");
+    }
+}
+
+void loadOrders() {
+    MetricTimer timer(METRIC_LOAD_ORDERS);
+    vector<Order> orders;
+    orderJournal.recover(orders);
+    
+    orderStore.reserve(orderStore.size() + orders.size());
+    for (Order& order : orders) {
+        // Orders saved before product ids were recorded join the catalog by name once
+        Product product = Product();
+        if (order.productId == 0 && catalog.findByName(order.productName, product)) {
+            order.productId = product.id;
+        }
+        orderStore.add(order);
+    }
+}
+
+// Writes a full snapshot of the order book and starts a fresh journal
+void saveOrders() {
+    MetricTimer timer(METRIC_SAVE_ORDERS);
+    orderJournal.compact(orderStore.orders(), false);
+}
+
+// Called after each journaled change; the snapshot is written off the UI thread
+void compactOrdersIfDue() {
+    if (orderJournal.compactionDue()) {
+        orderJournal.compact(orderStore.orders(), true);
+    }
+}
+
+
+// Product Persistence - catalog and stock changes only mark the catalog dirty;
+// a flusher thread writes them out in one batch when the flush interval passes,
+// when enough changes pile up, or at shutdown
+
+class ProductPersistence {
+public:
+    ProductPersistence() : dirtyChanges(0), stopping(false) {}
+    ~ProductPersistence() { stop(); }
+
+    void start() {
+        stopping = false;
+        flusher = thread(&ProductPersistence::flusherLoop, this);
+    }
+
+    void markDirty() {
+        lock_guard<mutex> guard(lock);
+        if (++dirtyChanges >= productFlushThreshold) wake.notify_all();
+    }
+
+    // Writes pending changes now
+    void flush() {
+        {
+            lock_guard<mutex> guard(lock);
+            if (dirtyChanges == 0) return;
+            dirtyChanges = 0;
+        }
+        saveProducts();
+    }
+
+    // Stops the flusher and writes whatever is still pending
+    void stop() {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+            wake.notify_all();
+        }
+        if (flusher.joinable()) flusher.join();
+        flush();
+    }
+
+private:
+    void flusherLoop() {
+        unique_lock<mutex> guard(lock);
+        while (!stopping) {
+            wake.wait_for(guard, chrono::milliseconds(productFlushMilliseconds), [this] {
+                return stopping || dirtyChanges >= productFlushThreshold;
+            });
+            if (dirtyChanges > 0) {
+                // Changes made while the file is written are counted again for the next flush
+                dirtyChanges = 0;
+                guard.unlock();
+                saveProducts();
+                guard.lock();
+            }
+        }
+    }
+
+    mutex lock;
+    condition_variable wake;
+    int dirtyChanges;
+    bool stopping;
+    thread flusher;
+};
+
+ProductPersistence productPersistence;
+
+
+// Metrics Export - data/metrics.prom is rewritten every metricsDumpSeconds so a
+// Prometheus node exporter (textfile collector) or a person can pick it up
+
+class MetricsExporter {
+public:
+    MetricsExporter() : running(false), stopping(false) {}
+    ~MetricsExporter() { stop(); }
+
+    // Does nothing unless metrics are on
+    void start() {
+        if (!metricsEnabled) return;
+        running = true;
+        stopping = false;
+        if (metricsDumpSeconds > 0) writer = thread(&MetricsExporter::writerLoop, this);
+    }
+
+    void dump() {
+        AtomicFileWriter file(metricsFile);
+        file.write(formatMetrics(metrics.snapshot()));
+        file.commit();
+    }
+
+    // Stops the writer and leaves the final numbers on disk
+    void stop() {
+        if (!running) return;
+        running = false;
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+            wake.notify_all();
+        }
+        if (writer.joinable()) writer.join();
+        dump();
+    }
+
+private:
+    void writerLoop() {
+        unique_lock<mutex> guard(lock);
+        while (!wake.wait_for(guard, chrono::seconds(metricsDumpSeconds), [this] { return stopping; })) {
+            guard.unlock();
+            dump();
+            guard.lock();
+        }
+    }
+
+    bool running;
+    mutex lock;
+    condition_variable wake;
+    bool stopping;
+    thread writer;
+};
+
+MetricsExporter metricsExporter;
+
+
+// Fulfillment - worker threads ship pending orders without an admin typing
+// usernames into the menu
+//
+// Each priority tier is a bounded lock-free ring (Vyukov's MPMC queue), so
+// checkouts and workers never contend on a lock to hand orders over. Orders
+// arriving while a ring is full spill into a locked overflow list that workers
+// move back into the ring once it runs dry, so neither a checkout nor start()
+// ever waits for shipping. Workers always drain the premium tier first; each
+// tier is FIFO. Time from checkout to delivery is tracked per tier so premium
+// service levels can be checked.
+
+template <typename T>
+class MpmcRing {
+public:
+    // `capacity` is rounded up to a power of two
+    explicit MpmcRing(size_t capacity = 1 << 16) : enqueuePos(0), dequeuePos(0) {
+        size_t size = 2;
+        while (size < capacity) size *= 2;
+        mask = size - 1;
+        cells.reset(new Cell[size]);
+        for (size_t i = 0; i < size; i++) cells[i].sequence.store(i, memory_order_relaxed);
+    }
+
+    bool push(const T& value) {
+        size_t pos = enqueuePos.load(memory_order_relaxed);
+        while (true) {
+            Cell& cell = cells[pos & mask];
+            intptr_t diff = (intptr_t)cell.sequence.load(memory_order_acquire) - (intptr_t)pos;
+            if (diff == 0) {
+                if (enqueuePos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+                    cell.value = value;
+                    cell.sequence.store(pos + 1, memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;  // Full
+            } else {
+                pos = enqueuePos.load(memory_order_relaxed);
+            }
+        }
+    }
+
+    bool pop(T& value) {
+        size_t pos = dequeuePos.load(memory_order_relaxed);
+        while (true) {
+            Cell& cell = cells[pos & mask];
+            intptr_t diff = (intptr_t)cell.sequence.load(memory_order_acquire) - (intptr_t)(pos + 1);
+            if (diff == 0) {
+                if (dequeuePos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+                    value = cell.value;
+                    cell.sequence.store(pos + mask + 1, memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;  // Empty
+            } else {
+                pos = dequeuePos.load(memory_order_relaxed);
+            }
+        }
+    }
+
+private:
+    struct Cell {
+        atomic<size_t> sequence;
+        T value;
+    };
+
+    unique_ptr<Cell[]> cells;
+    size_t mask;
+    alignas(64) atomic<size_t> enqueuePos;
+    alignas(64) atomic<size_t> dequeuePos;
+};
+
+struct FulfillmentStats {
+    long long delivered;
+    long long averageMicroseconds;
+    long long maxMicroseconds;
+};
+
+class FulfillmentCenter {
+public:
+    enum Tier { PREMIUM, STANDARD, TIERS };
+
+    FulfillmentCenter() : active(false), stopping(false), sleepers(0) {
+        for (int tier = 0; tier < TIERS; tier++) {
+            spilled[tier] = false;
+            delivered[tier] = 0;
+            totalLatency[tier] = 0;
+            maxLatency[tier] = 0;
+        }
+    }
+
+    ~FulfillmentCenter() { stop(); }
+
+    bool running() const { return active.load(); }
+
+    // Queues every order still pending and starts the workers
+    void start(int workerCount) {
+        if (workerCount <= 0 || running()) return;
+        stopping = false;
+        active = true;
+        vector<pair<size_t, int>> pending;
+        {
+            lock_guard<mutex> guard(orderBookMutex);
+            for (size_t slot : orderStore.withStatus("Pending")) {
+                pending.push_back(make_pair(slot, orderStore.at(slot).priority));
+            }
+        }
+        for (int i = 0; i < workerCount; i++) {
+            workers.emplace_back(&FulfillmentCenter::workerLoop, this);
+        }
+        for (const auto& order : pending) enqueue(order.first, order.second);
+    }
+
+    // Called after the order is in the order book; a no-op while fulfillment is off
+    void enqueue(size_t slot, int priority) {
+        if (!running()) return;
+        Ticket ticket = {slot, chrono::steady_clock::now()};
+        int tier = priority >= 2 ? PREMIUM : STANDARD;
+        // Once a tier has spilled, later orders queue behind the spill
+        if (spilled[tier].load() || !queues[tier].push(ticket)) {
+            lock_guard<mutex> guard(spillMutex);
+            spill[tier].push_back(ticket);
+            spilled[tier] = true;
+        }
+        if (sleepers.load() > 0) {
+            lock_guard<mutex> guard(idleMutex);
+            idle.notify_one();
+        }
+    }
+
+    // Queued orders stay Pending in the order book and are queued again next start
+    void stop() {
+        active = false;
+        {
+            lock_guard<mutex> guard(idleMutex);
+            stopping = true;
+            idle.notify_all();
+        }
+        for (thread& worker : workers) worker.join();
+        workers.clear();
+        Ticket ticket;
+        for (auto& queue : queues) {
+            while (queue.pop(ticket)) {}
+        }
+        lock_guard<mutex> guard(spillMutex);
+        for (int tier = 0; tier < TIERS; tier++) {
+            spill[tier].clear();
+            spilled[tier] = false;
+        }
+    }
+
+    FulfillmentStats stats(Tier tier) const {
+        long long count = delivered[tier].load();
+        FulfillmentStats result = {count, count > 0 ? totalLatency[tier].load() / count : 0, maxLatency[tier].load()};
+        return result;
+    }
+
+private:
+    struct Ticket {
+        size_t slot;
+        chrono::steady_clock::time_point queuedAt;
+    };
+
+    bool next(Ticket& ticket, Tier& tier) {
+        for (int t = 0; t < TIERS; t++) {
+            if (queues[t].pop(ticket) || (refill(t) && queues[t].pop(ticket))) {
+                tier = static_cast<Tier>(t);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Moves spilled orders back into the tier's ring, oldest first, while they fit
+    bool refill(int tier) {
+        if (!spilled[tier].load()) return false;
+        lock_guard<mutex> guard(spillMutex);
+        deque<Ticket>& waiting = spill[tier];
+        while (!waiting.empty() && queues[tier].push(waiting.front())) waiting.pop_front();
+        if (waiting.empty()) spilled[tier] = false;
+        return true;
+    }
+
+    void workerLoop() {
+        Ticket ticket;
+        Tier tier;
+        while (!stopping) {
+            if (!next(ticket, tier)) {
+                // The timeout covers a push that raced with going to sleep
+                unique_lock<mutex> guard(idleMutex);
+                sleepers++;
+                idle.wait_for(guard, chrono::milliseconds(10));
+                sleepers--;
+                continue;
+            }
+            if (fulfillmentShipMilliseconds > 0) {
+                this_thread::sleep_for(chrono::milliseconds(fulfillmentShipMilliseconds));
+            }
+            if (deliver(ticket.slot)) {
+                long long latency = chrono::duration_cast<chrono::microseconds>(
+                    chrono::steady_clock::now() - ticket.queuedAt).count();
+                delivered[tier]++;
+                totalLatency[tier] += latency;
+                long long seen = maxLatency[tier].load();
+                while (latency > seen && !maxLatency[tier].compare_exchange_weak(seen, latency)) {}
+            }
+        }
+    }
+
+    // False when the admin delivered the order in the meantime
+    bool deliver(size_t slot) {
+        MetricTimer timer(METRIC_FULFILLMENT);
+        lock_guard<mutex> guard(orderBookMutex);
+        const Order& order = orderStore.at(slot);
+        if (strcmp(order.status, "Pending") != 0) return false;
+        orderStore.setStatus(slot, "Delivered");
+        orderJournal.appendStatus(order.id, "Delivered");
+        ledger.append(LEDGER_CREDIT, order.totalAmount, order.username);
+        compactOrdersIfDue();
+        return true;
+    }
+
+    MpmcRing<Ticket> queues[TIERS];
+    mutex spillMutex;               // Guards spill
+    deque<Ticket> spill[TIERS];     // Orders that found their ring full
+    atomic<bool> spilled[TIERS];    // spill[tier] may be non-empty
+    vector<thread> workers;
+    atomic<bool> active;
+    atomic<bool> stopping;
+    atomic<int> sleepers;
+    mutex idleMutex;
+    condition_variable idle;
+    atomic<long long> delivered[TIERS];
+    atomic<long long> totalLatency[TIERS];
+    atomic<long long> maxLatency[TIERS];
+};
+
+FulfillmentCenter fulfillmentCenter;
+
+
+// Checkout Engine - stock is reserved when an item enters a cart and a cart
+// is committed as one unit, so concurrent sessions cannot oversell a product
+
+class CheckoutEngine {
+public:
+    enum Result { OK, PRODUCT_NOT_FOUND, OUT_OF_STOCK, EMPTY_CART };
+
+    Result addToCart(vector<CartItem>& cart, int productId, int quantity) {
+        MetricTimer timer(METRIC_ADD_TO_CART);
+        Product product = Product();
+        switch (catalog.reserve(productId, quantity, product)) {
+            case ProductCatalog::NOT_FOUND: return PRODUCT_NOT_FOUND;
+            case ProductCatalog::OUT_OF_STOCK:
+                countMetric(COUNTER_OUT_OF_STOCK);
+                return OUT_OF_STOCK;
+            case ProductCatalog::RESERVED: break;
+        }
+
+        CartItem item = CartItem();
+        item.productId = productId;
+        item.price = product.price;
+        item.quantity = quantity;
+        cart.push_back(item);
+        return OK;
+    }
+
+    // Abandons the cart and puts its reserved stock back
+    void releaseCart(vector<CartItem>& cart) {
+        for (const CartItem& item : cart) {
+            catalog.release(item.productId, item.quantity);
+        }
+        cart.clear();
+    }
+
+    // Turns every cart line into a pending order under one lock and one journal write
+    Result checkout(vector<CartItem>& cart, const string& username, Money& totalAmount) {
+        MetricTimer timer(METRIC_CHECKOUT);
+        totalAmount = Money::fromCents(0);
+        if (cart.empty()) {
+            countMetric(COUNTER_EMPTY_CHECKOUTS);
+            return EMPTY_CART;
+        }
+
+        vector<Order> orders;
+        orders.reserve(cart.size());
+        for (const CartItem& item : cart) {
+            Order order = Order();
+            Product product = Product();
+            catalog.findById(item.productId, product);  // Reserved, so it exists
+            strcpy(order.username, username.c_str());
+            order.productId = item.productId;
+            strcpy(order.productName, product.name);
+            order.quantity = item.quantity;
+            order.totalAmount = item.price * item.quantity;
+            strcpy(order.status, "Pending");
+            order.priority = (username.find("premium") != string::npos) ? 2 : 1;
+            orders.push_back(order);
+            totalAmount += order.totalAmount;
+        }
+
+        vector<size_t> slots;
+        {
+            lock_guard<mutex> guard(orderBookMutex);
+            for (Order& order : orders) {
+                slots.push_back(orderStore.add(order));
+                order.id = orderStore.at(slots.back()).id;
+            }
+            orderJournal.appendOrders(orders);
+            compactOrdersIfDue();
+        }
+        for (size_t i = 0; i < slots.size(); i++) {
+            fulfillmentCenter.enqueue(slots[i], orders[i].priority);
+        }
+        countMetric(COUNTER_ORDERS_PLACED, orders.size());
+        cart.clear();
+        return OK;
+    }
+};
+
+CheckoutEngine checkoutEngine;
+
+// --stress-checkout: many threads fight over one hot SKU; stock must never go
+// negative and every unit taken must show up as either an order or stock again
+bool enterBenchDirectory();
+void leaveBenchDirectory();
+
+// Simulates damage after the stress run, a garbage line halfway through the log
+// and a crash mid-append at its end: the restarted journal must recover every
+// order, drop only the torn record, and keep what it journals next
+bool journalSurvivesCrash() {
+    const vector<Order>& before = orderStore.orders();
+    {
+        ifstream in(ordersLogFile);
+        vector<string> lines;
+        string line;
+        while (getline(in, line)) lines.push_back(line);
+        in.close();
+        lines.insert(lines.begin() + lines.size() / 2, "N\tgarbage\t#@!");
+
+        ofstream log(ordersLogFile, ios::trunc);
+        for (const string& kept : lines) log << kept << '\n';
+        log << "N\t999999999\t" << before.size() + 1 << "\tcrashed";
+    }
+
+    vector<Order> recovered;
+    OrderJournal restarted;
+    restarted.recover(recovered);
+    bool same = recovered.size() == before.size();
+    for (size_t i = 0; same && i < before.size(); i++) {
+        same = recovered[i].id == before[i].id && strcmp(recovered[i].status, before[i].status) == 0;
+    }
+
+    Order order = Order();
+    order.id = recovered.empty() ? 1 : recovered.back().id + 1;
+    strcpy(order.username, "restarted");
+    strcpy(order.productName, "HotItem");
+    order.quantity = 1;
+    order.totalAmount = Money::fromCents(100);
+    strcpy(order.status, "Pending");
+    order.priority = 1;
+    restarted.open();
+    restarted.appendOrders(vector<Order>(1, order));
+    restarted.close();
+
+    vector<Order> reloaded;
+    OrderJournal again;
+    again.recover(reloaded);
+    bool kept = reloaded.size() == recovered.size() + 1 && reloaded.back().id == order.id;
+
+    // Log sequence numbers must keep rising past the restart
+    ifstream log(ordersLogFile);
+    string line;
+    unsigned long long previous = 0;
+    while (getline(log, line)) {
+        istringstream record(line);
+        string type;
+        unsigned long long recordLsn = 0;
+        if (!(record >> type >> recordLsn)) continue;  // The garbage line
+        if (recordLsn <= previous) kept = false;
+        previous = recordLsn;
+    }
+    return same && kept;
+}
+
+int runCheckoutStressTest(int threadCount, int rounds) {
+    const int hotProductId = 1;
+    const int initialStock = threadCount * rounds / 2;
+
+    Product hot = Product();
+    hot.id = hotProductId;
+    strcpy(hot.name, "HotItem");
+    hot.price = Money::fromCents(100);
+    hot.quantity = initialStock;
+    catalog.add(hot);
+    if (!enterBenchDirectory()) return 1;
+    orderJournal.open();
+    fulfillmentCenter.start(fulfillmentWorkers);
+
+    atomic<bool> oversold(false);
+    atomic<bool> running(true);
+    thread watcher([&] {
+        Product product = Product();
+        while (running.load()) {
+            if (catalog.findById(hotProductId, product) && product.quantity < 0) oversold = true;
+        }
+    });
+
+    vector<thread> shoppers;
+    for (int t = 0; t < threadCount; t++) {
+        shoppers.emplace_back([t, rounds] {
+            mt19937 rng(t);
+            string username = (t % 4 == 0 ? "premium_shopper" : "shopper") + to_string(t);
+            vector<CartItem> cart;
+            Money total;
+            for (int i = 0; i < rounds; i++) {
+                checkoutEngine.addToCart(cart, hotProductId, 1 + rng() % 3);
+                if (rng() % 4 == 0) {
+                    checkoutEngine.releaseCart(cart);
+                } else {
+                    checkoutEngine.checkout(cart, username, total);
+                }
+            }
+            checkoutEngine.releaseCart(cart);
+        });
+    }
+    for (thread& shopper : shoppers) shopper.join();
+    running = false;
+    watcher.join();
+    fulfillmentCenter.stop();
+    orderJournal.close();
+
+    Product product = Product();
+    catalog.findById(hotProductId, product);
+    long long ordered = 0;
+    Money delivered = Money::fromCents(0);
+    for (const Order& order : orderStore.orders()) {
+        ordered += order.quantity;
+        if (strcmp(order.status, "Delivered") == 0) delivered += order.totalAmount;
+    }
+
+    cout << "Threads: " << threadCount << ", rounds: " << rounds
+         << ", orders: " << orderStore.size() << ", units sold: " << ordered
+         << ", stock left: " << product.quantity << " of " << initialStock << endl;
+    if (fulfillmentWorkers > 0) {
+        cout << "Fulfillment workers: " << fulfillmentWorkers << ", delivered: "
+             << fulfillmentCenter.stats(FulfillmentCenter::PREMIUM).delivered << " premium, "
+             << fulfillmentCenter.stats(FulfillmentCenter::STANDARD).delivered << " standard" << endl;
+    }
+
+    // Every delivery must be credited exactly once
+    if (delivered != ledger.total(LEDGER_CREDIT)) {
+        UI::printError("Delivered orders and ledger credits disagree!");
+        leaveBenchDirectory();
+        return 1;
+    }
+    if (oversold || product.quantity < 0 || ordered + product.quantity != initialStock) {
+        UI::printError("Stock invariant violated!");
+        leaveBenchDirectory();
+        return 1;
+    }
+    UI::printSuccess("Stock never went negative and every unit is accounted for.");
+
+    bool survived = journalSurvivesCrash();
+    leaveBenchDirectory();
+    if (!survived) {
+        UI::printError("Orders were lost across a crash and restart!");
+        return 1;
+    }
+    UI::printSuccess("A damaged and a torn journal record were dropped and no order was lost on restart.");
+    return 0;
+}
+
+
+// Session Manager - every logged-in user owns a cart keyed by username
+//
+// Carts reserve stock as items are added, so a session idle for longer than
+// the cart timeout is expired by a reaper thread and its stock released back
+// to the catalog. Sessions for different users never share a lock beyond the
+// brief lookup in the session table.
+
+class SessionManager {
+public:
+    SessionManager() : timeout(cartTimeoutSeconds), stopping(false) {}
+    ~SessionManager() { stop(); }
+
+    void start(int timeoutSeconds) {
+        timeout = chrono::seconds(timeoutSeconds);
+        stopping = false;
+        reaper = thread(&SessionManager::reaperLoop, this);
+    }
+
+    // Runs `fn` on the user's cart, creating the session if needed
+    template <typename Fn>
+    void withCart(const string& username, Fn fn) {
+        while (true) {
+            shared_ptr<Session> session = find(username, true);
+            lock_guard<mutex> guard(session->lock);
+            if (session->expired) continue;  // Lost a race with the reaper; start over
+            session->lastActive = chrono::steady_clock::now();
+            fn(session->cart);
+            return;
+        }
+    }
+
+    vector<CartItem> cart(const string& username) {
+        vector<CartItem> items;
+        shared_ptr<Session> session = find(username, false);
+        if (session) {
+            lock_guard<mutex> guard(session->lock);
+            if (!session->expired) items = session->cart;
+        }
+        return items;
+    }
+
+    size_t activeSessions() {
+        lock_guard<mutex> guard(tableLock);
+        return sessions.size();
+    }
+
+    // Releases the stock of every session idle past the timeout; returns how many expired
+    size_t expireIdle() {
+        return expire(chrono::steady_clock::now() - timeout);
+    }
+
+    // Ends every session, e.g. at shutdown, so no stock stays reserved
+    size_t releaseAll() {
+        return expire(chrono::steady_clock::time_point::max());
+    }
+
+    void stop() {
+        {
+            lock_guard<mutex> guard(tableLock);
+            stopping = true;
+            wake.notify_all();
+        }
+        if (reaper.joinable()) reaper.join();
+    }
+
+private:
+    struct Session {
+        Session() : expired(false), lastActive(chrono::steady_clock::now()) {}
+        mutex lock;
+        bool expired;
+        chrono::steady_clock::time_point lastActive;
+        vector<CartItem> cart;
+    };
+
+    shared_ptr<Session> find(const string& username, bool create) {
+        lock_guard<mutex> guard(tableLock);
+        auto it = sessions.find(username);
+        if (it != sessions.end()) return it->second;
+        if (!create) return shared_ptr<Session>();
+        shared_ptr<Session> session = make_shared<Session>();
+        sessions.emplace(username, session);
+        return session;
+    }
+
+    size_t expire(chrono::steady_clock::time_point idleBefore) {
+        vector<shared_ptr<Session>> idle;
+        {
+            lock_guard<mutex> guard(tableLock);
+            for (auto it = sessions.begin(); it != sessions.end();) {
+                Session& session = *it->second;
+                unique_lock<mutex> sessionGuard(session.lock, try_to_lock);
+                // A session busy right now is by definition not idle
+                if (sessionGuard.owns_lock() && session.lastActive <= idleBefore) {
+                    session.expired = true;
+                    idle.push_back(it->second);
+                    it = sessions.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+        }
+
+        bool released = false;
+        for (const shared_ptr<Session>& session : idle) {
+            lock_guard<mutex> guard(session->lock);
+            released = released || !session->cart.empty();
+            checkoutEngine.releaseCart(session->cart);
+        }
+        if (released) productPersistence.markDirty();
+        countMetric(COUNTER_CARTS_EXPIRED, idle.size());
+        return idle.size();
+    }
+
+    void reaperLoop() {
+        unique_lock<mutex> guard(tableLock);
+        while (!stopping) {
+            chrono::seconds interval = max(chrono::seconds(1), chrono::duration_cast<chrono::seconds>(timeout / 4));
+            wake.wait_for(guard, interval);
+            if (stopping) break;
+            guard.unlock();
+            expireIdle();
+            guard.lock();
+        }
+    }
+
+    chrono::steady_clock::duration timeout;
+    mutex tableLock;
+    condition_variable wake;
+    bool stopping;
+    thread reaper;
+    unordered_map<string, shared_ptr<Session>> sessions;
+};
+
+
+// Bulk Import and Export - products, users and orders as CSV or JSON files
+//
+// The format follows the extension (.json, anything else is CSV). CSV files
+// carry a header row naming the columns; JSON files are an array of flat
+// objects. Imports read the file in blocks, split each block into records on
+// one thread and parse and validate the records on every core; the caller then
+// commits everything in one batch.
+
+struct BulkColumn {
+    const char* name;
+    bool numeric;  // Written unquoted in JSON
+};
+
+struct BulkReport {
+    BulkReport() : records(0), imported(0), rejected(0) {}
+
+    size_t records;
+    size_t imported;
+    size_t rejected;
+    vector<string> errors;  // The first few rejected records
+
+    void reject(size_t record, const string& reason) {
+        reject("record " + to_string(record) + ": " + reason);
+    }
+
+    void reject(const string& reason) {
+        rejected++;
+        if (errors.size() < 20) errors.push_back(reason);
+    }
+};
+
+bool bulkFileIsJson(const string& path) {
+    return path.size() >= 5 && toLower(path.substr(path.size() - 5)) == ".json";
+}
+
+struct BulkSpan {
+    size_t begin;
+    size_t end;
+    size_t number;  // Line number in CSV, object number in JSON
+};
+
+// Finds the complete records in `block` and returns how much of it they
+// cover; the rest is carried over to the next block
+size_t splitBulkRecords(const string& block, bool json, bool lastBlock, size_t& number,
+                        vector<BulkSpan>& spans) {
+    size_t consumed = 0;
+    if (!json) {
+        while (consumed < block.size()) {
+            size_t newline = block.find('\n', consumed);
+            if (newline == string::npos && !lastBlock) break;
+            size_t end = newline == string::npos ? block.size() : newline;
+            number++;
+            if (block.find_first_not_of(" \t\r", consumed) < end) {
+                spans.push_back(BulkSpan{consumed, end, number});
+            }
+            consumed = newline == string::npos ? block.size() : newline + 1;
+        }
+        return consumed;
+    }
+
+    int depth = 0;
+    bool inString = false, escaped = false;
+    size_t start = 0;
+    for (size_t i = 0; i < block.size(); i++) {
+        char c = block[i];
+        if (inString) {
+            if (escaped) escaped = false;
+            else if (c == '\\') escaped = true;
+            else if (c == '"') inString = false;
+        } else if (c == '"') {
+            inString = depth > 0;
+        } else if (c == '{') {
+            if (depth++ == 0) start = i;
+        } else if (c == '}' && depth > 0 && --depth == 0) {
+            spans.push_back(BulkSpan{start, i + 1, ++number});
+            consumed = i + 1;
+        }
+    }
+    return depth == 0 ? block.size() : consumed;
+}
+
+vector<string> parseCsvLine(const char* text, size_t size) {
+    vector<string> cells(1);
+    bool quoted = false;
+    for (size_t i = 0; i < size; i++) {
+        char c = text[i];
+        if (quoted) {
+            if (c == '"' && i + 1 < size && text[i + 1] == '"') {
+                cells.back() += '"';
+                i++;
+            } else if (c == '"') {
+                quoted = false;
+            } else {
+                cells.back() += c;
+            }
+        } else if (c == '"') {
+            quoted = true;
+        } else if (c == ',') {
+            cells.emplace_back();
+        } else if (c != '\r') {
+            cells.back() += c;
+        }
+    }
+    return cells;
+}
+
+// Fills `fields` (in column order) from one flat JSON object
+void parseJsonObject(const char* text, size_t size, const vector<BulkColumn>& columns, vector<string>& fields) {
+    size_t i = 0;
+    auto skipSpace = [&] { while (i < size && (isspace((unsigned char)text[i]) || text[i] == ',' || text[i] == '{')) i++; };
+    auto readValue = [&](string& value) {
+        value.clear();
+        if (i < size && text[i] == '"') {
+            for (i++; i < size && text[i] != '"'; i++) {
+                if (text[i] != '\\' || i + 1 >= size) {
+                    value += text[i];
+                    continue;
+                }
+                char escape = text[++i];
+                if (escape == 'n') value += '\n';
+                else if (escape == 't') value += '\t';
+                else if (escape == 'u') { value += '?'; i += 4; }
+                else value += escape;
+            }
+            i++;
+        } else {
+            while (i < size && text[i] != ',' && text[i] != '}' && !isspace((unsigned char)text[i])) value += text[i++];
+        }
+    };
+
+    string key, value;
+    while (true) {
+        skipSpace();
+        if (i >= size || text[i] == '}') return;
+        readValue(key);
+        while (i < size && (isspace((unsigned char)text[i]) || text[i] == ':')) i++;
+        readValue(value);
+        for (size_t column = 0; column < columns.size(); column++) {
+            if (key == columns[column].name) fields[column] = value;
+        }
+    }
+}
+
+// Runs work(begin, end) over [0, count) split across the available cores
+template <typename Work>
+void parallelRanges(size_t count, Work work) {
+    size_t workers = min<size_t>(max(1u, thread::hardware_concurrency()), max<size_t>(count / 1024, 1));
+    vector<thread> threads;
+    for (size_t w = 1; w < workers; w++) {
+        threads.emplace_back(work, count * w / workers, count * (w + 1) / workers);
+    }
+    work(0, count / workers);
+    for (thread& worker : threads) worker.join();
+}
+
+// Parses every record of `path` into `records`. `convert` validates the fields
+// of one record and returns an empty string or the reason it was rejected.
+// Returns false when the file cannot be read or lacks a column.
+template <typename T, typename Convert>
+bool readBulkFile(const string& path, const vector<BulkColumn>& columns, Convert convert,
+                  vector<T>& records, BulkReport& report) {
+    ifstream in(path, ios::binary);
+    if (!in) {
+        report.errors.push_back("cannot open " + path);
+        return false;
+    }
+
+    const bool json = bulkFileIsJson(path);
+    const size_t blockSize = 16 << 20;
+    vector<size_t> csvColumns;  // CSV cell index of each column
+    size_t number = 0;
+    string block;
+    vector<BulkSpan> spans;
+
+    while (true) {
+        size_t carried = block.size();
+        block.resize(carried + blockSize);
+        in.read(&block[carried], blockSize);
+        block.resize(carried + in.gcount());
+        bool lastBlock = !in;
+
+        spans.clear();
+        size_t consumed = splitBulkRecords(block, json, lastBlock, number, spans);
+
+        size_t first = 0;
+        if (!json && csvColumns.empty() && !spans.empty()) {
+            vector<string> header = parseCsvLine(block.data() + spans[0].begin, spans[0].end - spans[0].begin);
+            for (const BulkColumn& column : columns) {
+                auto found = find(header.begin(), header.end(), column.name);
+                if (found == header.end()) {
+                    report.errors.push_back(string("missing column ") + column.name);
+                    return false;
+                }
+                csvColumns.push_back(found - header.begin());
+            }
+            first = 1;
+        }
+
+        size_t count = spans.size() - first;
+        vector<T> parsed(count);
+        vector<string> reasons(count);
+        parallelRanges(count, [&](size_t begin, size_t end) {
+            vector<string> fields(columns.size());
+            for (size_t i = begin; i < end; i++) {
+                const BulkSpan& span = spans[first + i];
+                if (json) {
+                    fill(fields.begin(), fields.end(), string());
+                    parseJsonObject(block.data() + span.begin, span.end - span.begin, columns, fields);
+                } else {
+                    vector<string> cells = parseCsvLine(block.data() + span.begin, span.end - span.begin);
+                    for (size_t column = 0; column < columns.size(); column++) {
+                        fields[column] = csvColumns[column] < cells.size() ? cells[csvColumns[column]] : "";
+                    }
+                }
+                reasons[i] = convert(fields, parsed[i]);
+            }
+        });
+
+        for (size_t i = 0; i < count; i++) {
+            report.records++;
+            if (reasons[i].empty()) {
+                records.push_back(parsed[i]);
+            } else {
+                report.reject(spans[first + i].number, reasons[i]);
+            }
+        }
+
+        block.erase(0, consumed);
+        if (lastBlock) break;
+    }
+    return true;
+}
+
+// Streams rows into a CSV or JSON file that replaces `path` once complete
+class BulkWriter {
+public:
+    BulkWriter(const string& path, const vector<BulkColumn>& columns)
+        : file(path.c_str()), columns(columns), json(bulkFileIsJson(path)), rows(0) {
+        if (json) {
+            buffer += "[";
+            return;
+        }
+        for (size_t i = 0; i < columns.size(); i++) {
+            buffer += (i > 0 ? "," : "") + string(columns[i].name);
+        }
+        buffer += '\n';
+    }
+
+    void row(const vector<string>& values) {
+        if (json) {
+            buffer += rows > 0 ? ",\n  {" : "\n  {";
+            for (size_t i = 0; i < columns.size(); i++) {
+                buffer += (i > 0 ? ", \"" : "\"") + string(columns[i].name) + "\": ";
+                if (columns[i].numeric) {
+                    buffer += values[i];
+                } else {
+                    appendJsonString(values[i]);
+                }
+            }
+            buffer += '}';
+        } else {
+            for (size_t i = 0; i < columns.size(); i++) {
+                if (i > 0) buffer += ',';
+                appendCsvCell(values[i]);
+            }
+            buffer += '\n';
+        }
+        rows++;
+        if (buffer.size() >= (1 << 20)) {
+            file.write(buffer);
+            buffer.clear();
+        }
+    }
+
+    bool finish() {
+        if (json) buffer += "\n]\n";
+        file.write(buffer);
+        buffer.clear();
+        return file.commit();
+    }
+
+private:
+    void appendCsvCell(const string& value) {
+        if (value.find_first_of(",\"\n") == string::npos) {
+            buffer += value;
+            return;
+        }
+        buffer += '"';
+        for (char c : value) {
+            if (c == '"') buffer += '"';
+            buffer += c;
+        }
+        buffer += '"';
+    }
+
+    void appendJsonString(const string& value) {
+        buffer += '"';
+        for (char c : value) {
+            if (c == '"' || c == '\\') buffer += '\\';
+            if (c == '\n') {
+                buffer += "\\n";
+                continue;
+            }
+            buffer += c;
+        }
+        buffer += '"';
+    }
+
+    AtomicFileWriter file;
+    vector<BulkColumn> columns;
+    bool json;
+    size_t rows;
+    string buffer;
+};
+
+
+// Store - the business operations behind the console menus, free of console I/O
+//
+// Everything the menus can do is available here, so the store can be driven
+// by other code (batch jobs, benchmarks, services) without a terminal.
+
+enum StoreResult {
+    STORE_OK,
+    USERNAME_TAKEN,
+    INVALID_USERNAME,
+    WEAK_PASSWORD,
+    INVALID_EMAIL,
+    BAD_CREDENTIALS,
+    INVALID_PRODUCT_NAME,
+    INVALID_PRICE,
+    INVALID_QUANTITY,
+    PRODUCT_NOT_FOUND,
+    OUT_OF_STOCK,
+    EMPTY_CART,
+    NO_PENDING_ORDERS,
+    ORDER_NOT_FOUND,
+    ORDER_NOT_PENDING,
+    INVALID_AMOUNT,
+    INSUFFICIENT_FUNDS,
+    STORAGE_ERROR
+};
+
+string describe(StoreResult result) {
+    switch (result) {
+        case STORE_OK: return "OK";
+        case USERNAME_TAKEN: return "Username already exists or is invalid!";
+        case INVALID_USERNAME: return "Username already exists or is invalid!";
+        case WEAK_PASSWORD: return "Password must be at least 6 characters with both letters and numbers!";
+        case INVALID_EMAIL: return "Invalid email format!";
+        case BAD_CREDENTIALS: return "Invalid username or password!";
+        case INVALID_PRODUCT_NAME: return "Invalid product name! Use 1-49 characters without spaces.";
+        case INVALID_PRICE: return "Invalid price! Enter a number.";
+        case INVALID_QUANTITY: return "Invalid quantity! Enter a positive number.";
+        case PRODUCT_NOT_FOUND: return "Product not found!";
+        case OUT_OF_STOCK: return "Not enough stock available!";
+        case EMPTY_CART: return "Your cart is empty!";
+        case NO_PENDING_ORDERS: return "No pending orders found for that username!";
+        case ORDER_NOT_FOUND: return "Order not found!";
+        case ORDER_NOT_PENDING: return "That order is not pending!";
+        case INVALID_AMOUNT: return "Invalid amount! Enter a positive number.";
+        case INSUFFICIENT_FUNDS: return "Insufficient funds!";
+        case STORAGE_ERROR: return "Error accessing data files!";
+    }
+    return "Unknown error!";
+}
+
+class Store {
+public:
+    bool userExists(const string& username) {
+        lock_guard<mutex> guard(usersMutex);
+        return userMap.find(username) != userMap.end();
+    }
+
+    // The field rules shared by the single-record operations and bulk imports
+    // A password that is already hashed only has to fit the record
+    static StoreResult checkUser(const string& username, const string& password, const string& email,
+                                 bool hashed = false) {
+        if (!usernameValid(username)) return INVALID_USERNAME;
+        if (!(hashed || passwordValid(password)) || password.size() >= sizeof(User().password)) return WEAK_PASSWORD;
+        if (!emailValid(email) || email.size() >= sizeof(User().email)) return INVALID_EMAIL;
+        return STORE_OK;
+    }
+
+    // Names are whitespace-delimited in products.txt and orders.txt
+    static StoreResult checkProduct(const string& name, Money price, int quantity) {
+        if (name.empty() || name.size() >= sizeof(Product().name) ||
+            name.find_first_of(" \t\r\n") != string::npos) return INVALID_PRODUCT_NAME;
+        if (price.cents < 0) return INVALID_PRICE;
+        if (quantity < 0) return INVALID_QUANTITY;
+        return STORE_OK;
+    }
+
+    StoreResult registerUser(const string& username, const string& password, const string& email) {
+        StoreResult result = checkUser(username, password, email);
+        if (result != STORE_OK) return result;
+        if (userExists(username)) return USERNAME_TAKEN;  // Don't pay for a hash first
+
+        User user = User();
+        strcpy(user.username, username.c_str());
+        strcpy(user.password, passwordHasher.hash(password).get().c_str());
+        strcpy(user.email, email.c_str());
+
+        lock_guard<mutex> guard(usersMutex);
+        if (!userMap.emplace(username, user).second) return USERNAME_TAKEN;
+        saveUsers();
+        return STORE_OK;
+    }
+
+    // Hashing runs without usersMutex held, so other sessions aren't stalled by it
+    StoreResult login(const string& username, const string& password) {
+        MetricTimer timer(METRIC_LOGIN);
+        string stored;
+        {
+            lock_guard<mutex> guard(usersMutex);
+            auto it = userMap.find(username);
+            if (it != userMap.end()) stored = it->second.password;
+        }
+        if (stored.empty() || !passwordHasher.verify(password, stored).get()) {
+            countMetric(COUNTER_FAILED_LOGINS);
+            return BAD_CREDENTIALS;
+        }
+
+        // Legacy plaintext or an older work factor: store a fresh hash
+        if (passwordHashIterations(stored) != passwordIterations) {
+            string upgraded = passwordHasher.hash(password).get();
+            lock_guard<mutex> guard(usersMutex);
+            auto it = userMap.find(username);
+            if (it != userMap.end() && stored == it->second.password) {
+                strcpy(it->second.password, upgraded.c_str());
+                saveUsers();
+            }
+        }
+        return STORE_OK;
+    }
+
+    StoreResult adminLogin(const string& password) {
+        string stored;
+        if (!adminCredential(stored)) return STORAGE_ERROR;
+        if (!passwordHasher.verify(password, stored).get()) return BAD_CREDENTIALS;
+
+        if (passwordHashIterations(stored) != passwordIterations) {
+            replaceAdminCredential(stored, passwordHasher.hash(password).get());
+        }
+        return STORE_OK;
+    }
+
+    // The current password is verified here only, once
+    StoreResult changeAdminPassword(const string& currentPassword, const string& newPassword) {
+        string stored;
+        if (!adminCredential(stored)) return STORAGE_ERROR;
+        if (!passwordHasher.verify(currentPassword, stored).get()) return BAD_CREDENTIALS;
+        if (!passwordValid(newPassword)) return WEAK_PASSWORD;
+        return replaceAdminCredential(stored, passwordHasher.hash(newPassword).get());
+    }
+
+    StoreResult addProduct(const string& name, Money price, int quantity, int* productId = NULL) {
+        StoreResult result = checkProduct(name, price, quantity);
+        if (result != STORE_OK) return result;
+
+        Product product = Product();
+        strcpy(product.name, name.c_str());
+        product.price = price;
+        product.quantity = quantity;
+        {
+            lock_guard<mutex> guard(productIdMutex);
+            product.id = nextProductId++;
+            addProductToCatalog(product);
+        }
+        productPersistence.markDirty();
+        if (productId != NULL) *productId = product.id;
+        return STORE_OK;
+    }
+
+    // Bulk imports: every record goes through the same rules as addProduct,
+    // registerUser and checkout, and the accepted ones are committed at once
+
+    StoreResult importProducts(const string& path, BulkReport& report) {
+        vector<Product> products;
+        auto convert = [](const vector<string>& fields, Product& product) -> string {
+            if (!priceValid(fields[1])) return describe(INVALID_PRICE);
+            if (!quantityValid(fields[2])) return describe(INVALID_QUANTITY);
+            StoreResult result = checkProduct(fields[0], toMoney(fields[1]), stoi(fields[2]));
+            if (result != STORE_OK) return describe(result);
+            strcpy(product.name, fields[0].c_str());
+            product.price = toMoney(fields[1]);
+            product.quantity = stoi(fields[2]);
+            return "";
+        };
+        if (!readBulkFile(path, productImportColumns(), convert, products, report)) return STORAGE_ERROR;
+
+        {
+            lock_guard<mutex> guard(productIdMutex);
+            for (Product& product : products) {
+                product.id = nextProductId++;
+            }
+            addProductsToCatalog(products.data(), products.data() + products.size());
+        }
+        report.imported = products.size();
+        productPersistence.markDirty();
+        productPersistence.flush();
+        return STORE_OK;
+    }
+
+    // Plaintext passwords are hashed by the parser threads themselves, which
+    // already spread the work over every core; existing hashes are kept as is
+    StoreResult importUsers(const string& path, BulkReport& report) {
+        vector<User> users;
+        auto convert = [](const vector<string>& fields, User& user) -> string {
+            bool hashed = isPasswordHash(fields[1]);
+            StoreResult result = checkUser(fields[0], fields[1], fields[2], hashed);
+            if (result != STORE_OK) return describe(result);
+            strcpy(user.username, fields[0].c_str());
+            strcpy(user.password, hashed ? fields[1].c_str() : hashPassword(fields[1], passwordIterations).c_str());
+            strcpy(user.email, fields[2].c_str());
+            return "";
+        };
+        if (!readBulkFile(path, userColumns(), convert, users, report)) return STORAGE_ERROR;
+
+        lock_guard<mutex> guard(usersMutex);
+        for (const User& user : users) {
+            if (userMap.emplace(user.username, user).second) {
+                report.imported++;
+            } else {
+                report.reject(string("username ") + user.username + " already exists");
+            }
+        }
+        saveUsers();
+        return STORE_OK;
+    }
+
+    StoreResult importOrders(const string& path, BulkReport& report) {
+        vector<Order> orders;
+        auto convert = [](const vector<string>& fields, Order& order) -> string {
+            if (!usernameValid(fields[0])) return describe(INVALID_USERNAME);
+            StoreResult product = checkProduct(fields[1], Money::fromCents(0), 0);
+            if (product != STORE_OK) return describe(product);
+            if (!quantityValid(fields[2]) || stoi(fields[2]) <= 0) return describe(INVALID_QUANTITY);
+            if (!priceValid(fields[3]) || toMoney(fields[3]).cents < 0) return describe(INVALID_AMOUNT);
+            if (fields[4] != "Pending" && fields[4] != "Delivered") return "status must be Pending or Delivered";
+            if (!quantityValid(fields[5])) return "invalid priority";
+            Product known = Product();
+            if (catalog.findByName(fields[1], known)) order.productId = known.id;
+            strcpy(order.username, fields[0].c_str());
+            strcpy(order.productName, fields[1].c_str());
+            order.quantity = stoi(fields[2]);
+            order.totalAmount = toMoney(fields[3]);
+            strcpy(order.status, fields[4].c_str());
+            order.priority = stoi(fields[5]);
+            return "";
+        };
+        if (!readBulkFile(path, orderColumns(), convert, orders, report)) return STORAGE_ERROR;
+
+        Money delivered = Money::fromCents(0);
+        vector<pair<size_t, int>> pending;
+        {
+            lock_guard<mutex> guard(orderBookMutex);
+            for (Order& order : orders) {
+                size_t slot = orderStore.add(order);
+                order.id = orderStore.at(slot).id;
+                if (strcmp(order.status, "Delivered") == 0) {
+                    delivered += order.totalAmount;
+                } else {
+                    pending.push_back(make_pair(slot, order.priority));
+                }
+            }
+            orderJournal.appendOrders(orders);
+            if (delivered.cents != 0) ledger.append(LEDGER_CREDIT, delivered, "import");
+            compactOrdersIfDue();
+        }
+        for (const auto& order : pending) {
+            fulfillmentCenter.enqueue(order.first, order.second);
+        }
+        report.imported = orders.size();
+        return STORE_OK;
+    }
+
+    // Exports copy the records under their lock and write the file without it
+    StoreResult exportProducts(const string& path, size_t& rows) {
+        vector<Product> products = catalog.snapshot();
+        vector<BulkColumn> columns = productImportColumns();
+        columns.insert(columns.begin(), BulkColumn{"id", true});
+        BulkWriter writer(path, columns);
+        for (const Product& product : products) {
+            writer.row({to_string(product.id), product.name, product.price.str(), to_string(product.quantity)});
+        }
+        rows = products.size();
+        return writer.finish() ? STORE_OK : STORAGE_ERROR;
+    }
+
+    StoreResult exportUsers(const string& path, size_t& rows) {
+        vector<User> users;
+        {
+            lock_guard<mutex> guard(usersMutex);
+            for (const auto& pair : userMap) users.push_back(pair.second);
+        }
+        BulkWriter writer(path, userColumns());
+        for (const User& user : users) {
+            writer.row({user.username, user.password, user.email});
+        }
+        rows = users.size();
+        return writer.finish() ? STORE_OK : STORAGE_ERROR;
+    }
+
+    StoreResult exportOrders(const string& path, size_t& rows) {
+        vector<Order> orders;
+        {
+            lock_guard<mutex> guard(orderBookMutex);
+            orders = orderStore.orders();
+        }
+        BulkWriter writer(path, orderColumns());
+        for (const Order& order : orders) {
+            writer.row({order.username, order.productName, to_string(order.quantity), order.totalAmount.str(),
+                        order.status, to_string(order.priority)});
+        }
+        rows = orders.size();
+        return writer.finish() ? STORE_OK : STORAGE_ERROR;
+    }
+
+    StoreResult addToCart(const string& username, int productId, int quantity) {
+        if (quantity <= 0) return INVALID_QUANTITY;
+        CheckoutEngine::Result result;
+        sessions.withCart(username, [&](vector<CartItem>& cart) {
+            result = checkoutEngine.addToCart(cart, productId, quantity);
+        });
+        switch (result) {
+            case CheckoutEngine::PRODUCT_NOT_FOUND: return PRODUCT_NOT_FOUND;
+            case CheckoutEngine::OUT_OF_STOCK: return OUT_OF_STOCK;
+            default: break;
+        }
+        productPersistence.markDirty();
+        return STORE_OK;
+    }
+
+    vector<CartItem> cart(const string& username) {
+        return sessions.cart(username);
+    }
+
+    vector<Product> searchProducts(const ProductQuery& query) {
+        return catalog.search(query);
+    }
+
+    void productPage(ProductSort sort, size_t offset, size_t count, vector<Product>& rows) {
+        catalog.page(sort, offset, count, rows);
+    }
+
+    size_t productCount() {
+        return catalog.size();
+    }
+
+    StoreResult checkout(const string& username, Money& totalAmount) {
+        CheckoutEngine::Result result;
+        sessions.withCart(username, [&](vector<CartItem>& cart) {
+            result = checkoutEngine.checkout(cart, username, totalAmount);
+        });
+        return result == CheckoutEngine::EMPTY_CART ? EMPTY_CART : STORE_OK;
+    }
+
+    void startSessions() {
+        sessions.start(cartTimeoutSeconds);
+    }
+
+    // Stops the reaper and hands back the stock held by carts that were never checked out
+    void shutdown() {
+        sessions.stop();
+        sessions.releaseAll();
+    }
+
+    // Delivered orders of one customer, oldest first
+    vector<Order> orderHistory(const string& username) {
+        MetricTimer timer(METRIC_ORDER_HISTORY);
+        lock_guard<mutex> guard(orderBookMutex);
+        vector<Order> history;
+        for (size_t slot : orderStore.forUser(username)) {
+            const Order& order = orderStore.at(slot);
+            if (strcmp(order.status, "Delivered") == 0) history.push_back(order);
+        }
+        return history;
+    }
+
+    // Orders with the given status ("" for all) in fulfillment order
+    vector<Order> orders(const string& status = "") {
+        MetricTimer timer(METRIC_ORDER_LIST);
+        lock_guard<mutex> guard(orderBookMutex);
+        const OrderStore::SlotSet& slots = status.empty() ? orderStore.all() : orderStore.withStatus(status);
+        vector<Order> result;
+        result.reserve(slots.size());
+        for (size_t slot : slots) {
+            result.push_back(orderStore.at(slot));
+        }
+        return result;
+    }
+
+    // Delivers every pending order of the customer and credits the site balance
+    StoreResult markDelivered(const string& username) {
+        MetricTimer timer(METRIC_MARK_DELIVERED);
+        lock_guard<mutex> guard(orderBookMutex);
+        vector<size_t> pending;
+        for (size_t slot : orderStore.forUser(username)) {
+            if (strcmp(orderStore.at(slot).status, "Pending") == 0) pending.push_back(slot);
+        }
+        if (pending.empty()) return NO_PENDING_ORDERS;
+
+        for (size_t slot : pending) {
+            deliverSlot(slot);
+        }
+        compactOrdersIfDue();
+        return STORE_OK;
+    }
+
+    // Delivers one order, found through the id index
+    StoreResult markOrderDelivered(long long id) {
+        MetricTimer timer(METRIC_MARK_DELIVERED);
+        lock_guard<mutex> guard(orderBookMutex);
+        size_t slot;
+        if (!orderStore.find(id, slot)) return ORDER_NOT_FOUND;
+        if (strcmp(orderStore.at(slot).status, "Pending") != 0) return ORDER_NOT_PENDING;
+
+        deliverSlot(slot);
+        compactOrdersIfDue();
+        return STORE_OK;
+    }
+
+    SalesTotals salesTotals() {
+        lock_guard<mutex> guard(orderBookMutex);
+        return orderStore.analytics().totals();
+    }
+
+    SalesTotals scanSales(const SalesQuery& query) {
+        lock_guard<mutex> guard(orderBookMutex);
+        return orderStore.analytics().scan(query);
+    }
+
+    vector<SalesRanking> topProducts(size_t count) {
+        lock_guard<mutex> guard(orderBookMutex);
+        return orderStore.analytics().topProducts(count);
+    }
+
+    vector<SalesRanking> topCustomers(size_t count) {
+        lock_guard<mutex> guard(orderBookMutex);
+        return orderStore.analytics().topCustomers(count);
+    }
+
+    Money balance() {
+        lock_guard<mutex> guard(orderBookMutex);
+        return ledger.balance();
+    }
+
+    StoreResult deposit(Money amount) {
+        if (amount.cents <= 0) return INVALID_AMOUNT;
+        lock_guard<mutex> guard(orderBookMutex);
+        ledger.append(LEDGER_DEPOSIT, amount);
+        return STORE_OK;
+    }
+
+    StoreResult withdraw(Money amount) {
+        if (amount.cents <= 0) return INVALID_AMOUNT;
+        lock_guard<mutex> guard(orderBookMutex);
+        if (amount > ledger.balance()) return INSUFFICIENT_FUNDS;
+        ledger.append(LEDGER_WITHDRAWAL, amount);
+        return STORE_OK;
+    }
+
+private:
+    static vector<BulkColumn> productImportColumns() {
+        return {{"name", false}, {"price", true}, {"quantity", true}};
+    }
+
+    static vector<BulkColumn> userColumns() {
+        return {{"username", false}, {"password", false}, {"email", false}};
+    }
+
+    static vector<BulkColumn> orderColumns() {
+        return {{"username", false}, {"product", false}, {"quantity", true},
+                {"total", true}, {"status", false}, {"priority", true}};
+    }
+
+    // The delivery is journaled before it is credited, so a crash in between
+    // can never credit the same order twice. Caller holds orderBookMutex.
+    void deliverSlot(size_t slot) {
+        orderStore.setStatus(slot, "Delivered");
+        const Order& order = orderStore.at(slot);
+        orderJournal.appendStatus(order.id, "Delivered");
+        ledger.append(LEDGER_CREDIT, order.totalAmount, order.username);
+    }
+
+    // admin.txt is read once; afterwards the cached credential changes only
+    // together with the file
+    bool adminCredential(string& stored) {
+        lock_guard<mutex> guard(adminMutex);
+        if (!adminLoaded) {
+            string contents;
+            if (!readDataFile(adminFile, contents)) return false;
+            istringstream in(contents);
+            in >> cachedAdminCredential;
+            adminLoaded = true;
+        }
+        stored = cachedAdminCredential;
+        return true;
+    }
+
+    // Swaps in a new credential unless another change got there first
+    StoreResult replaceAdminCredential(const string& expected, const string& replacement) {
+        lock_guard<mutex> guard(adminMutex);
+        if (cachedAdminCredential != expected) return BAD_CREDENTIALS;
+
+        AtomicFileWriter file(adminFile, AtomicFileWriter::KEEP_BACKUP | AtomicFileWriter::CHECKSUM_FOOTER);
+        file.write(replacement + "\n");
+        if (!file.commit()) return STORAGE_ERROR;
+        cachedAdminCredential = replacement;
+        return STORE_OK;
+    }
+
+    SessionManager sessions;
+    mutex usersMutex;
+    mutex adminMutex;
+    string cachedAdminCredential;
+    bool adminLoaded = false;
+    mutex productIdMutex;
+};
+
+Store store;
+
+
+// Benchmarks - --bench [max records] times the core operations on synthetic data
+//
+// Each scale, from 10^3 records up to the maximum by powers of ten, starts
+// from an empty store inside a scratch "bench" directory, so the real data
+// files are never touched. Saves and loads are timed once over the whole data
+// set; the other operations are timed call by call and reported with their
+// median and 99th percentile latency. The heap the timed code leaves behind is
+// reported too, per record or per call, from the allocator's own statistics
+// (glibc only), so the process-wide allocator is never replaced.
+
+const char benchDirectory[] = "bench";
+const size_t benchOperations = 100000;  // Timed calls per operation and scale, at most
+
+// Bytes of heap in use, or -1 where the C library cannot tell
+long long heapInUse() {
+    #ifdef HAVE_MALLINFO2
+    struct mallinfo2 info = mallinfo2();
+    return (long long)(info.uordblks + info.hblkhd);
+    #else
+    return -1;
+    #endif
+}
+
+// Times calls one by one. The heap is read once before and once after the
+// whole phase, since reading it walks the allocator's free lists.
+class BenchTimer {
+public:
+    // Room for every sample up front, so they do not count as heap kept
+    explicit BenchTimer(size_t calls = 1) {
+        samples.reserve(calls);
+        heapBefore = heapInUse();
+    }
+
+    template <typename Fn>
+    void time(Fn fn) {
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        fn();
+        samples.push_back(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+    }
+
+    // Heap the phase kept so far, negative if it freed more than it kept
+    long long heapGrowth() const {
+        return heapInUse() - heapBefore;
+    }
+
+    vector<long long> samples;
+
+private:
+    long long heapBefore;
+};
+
+class BenchReport {
+public:
+    BenchReport() {
+        cout << left << setw(10) << "Records" << setw(16) << "Operation" << right << setw(10) << "Ops"
+             << setw(14) << "Ops/s" << setw(12) << "p50 us" << setw(12) << "p99 us" << setw(12) << "Heap B/op"
+             << endl;
+    }
+
+    // One call that handles `count` records
+    void pass(size_t records, const string& name, size_t count, const BenchTimer& timer) {
+        long long growth = timer.heapGrowth();
+        row(records, name, count, timer.samples[0]);
+        cout << setw(12) << "-" << setw(12) << "-";
+        heap(growth, count);
+    }
+
+    // One sample per call
+    void latencies(size_t records, const string& name, BenchTimer& timer) {
+        long long growth = timer.heapGrowth();
+        vector<long long>& samples = timer.samples;
+        if (samples.empty()) return;
+        long long total = 0;
+        for (long long sample : samples) total += sample;
+        sort(samples.begin(), samples.end());
+        row(records, name, samples.size(), total);
+        cout << setw(12) << samples[samples.size() / 2] / 1000.0
+             << setw(12) << samples[min(samples.size() - 1, samples.size() * 99 / 100)] / 1000.0;
+        heap(growth, samples.size());
+    }
+
+private:
+    static void heap(long long growth, size_t count) {
+        if (heapInUse() < 0) {
+            cout << setw(12) << "-" << endl;
+        } else {
+            cout << setw(12) << (double)growth / count << endl;
+        }
+    }
+
+    static void row(size_t records, const string& name, size_t count, long long nanoseconds) {
+        double perSecond = nanoseconds > 0 ? count * 1e9 / nanoseconds : 0;
+        cout << left << setw(10) << records << setw(16) << name << right << setw(10) << count
+             << fixed << setprecision(0) << setw(14) << perSecond << setprecision(2);
+    }
+};
+
+// Times one call that handles a whole data set
+template <typename Fn>
+BenchTimer timePass(Fn fn) {
+    BenchTimer timer;
+    timer.time(fn);
+    return timer;
+}
+
+string benchUsername(size_t n) {
+    return (n % 4 == 0 ? "premium_shopper" : "shopper") + to_string(n);
+}
+
+// Fills the catalog, users and order book; half of the orders are delivered
+void populateBenchStore(size_t records, size_t users) {
+    catalog.clear();
+    orderStore.clear();
+    userMap.clear();
+    nextProductId = 1;
+
+    vector<Product> products(records);
+    for (size_t i = 0; i < records; i++) {
+        products[i].id = (int)i + 1;
+        snprintf(products[i].name, sizeof(products[i].name), "Product%lu", (unsigned long)i + 1);
+        products[i].price = Money::fromCents(100 + i % 9900);
+        products[i].quantity = 1000000;
+    }
+    addProductsToCatalog(products.data(), products.data() + records);
+
+    for (size_t i = 0; i < users; i++) {
+        User user = User();
+        string username = benchUsername(i);
+        strcpy(user.username, username.c_str());
+        strcpy(user.password, "pbkdf2$1$00$00");
+        strcpy(user.email, (username + "@example.com").c_str());
+        userMap[username] = user;
+    }
+
+    for (size_t i = 0; i < records; i++) {
+        const Product& product = products[(i * 7919) % records];
+        Order order = Order();
+        string username = benchUsername(i % users);
+        strcpy(order.username, username.c_str());
+        order.productId = product.id;
+        strcpy(order.productName, product.name);
+        order.quantity = 1 + i % 3;
+        order.totalAmount = product.price * order.quantity;
+        strcpy(order.status, i % 2 == 0 ? "Pending" : "Delivered");
+        order.priority = (username.find("premium") != string::npos) ? 2 : 1;
+        orderStore.add(order);
+    }
+}
+
+void runBenchScale(size_t records, BenchReport& report) {
+    size_t users = max<size_t>(records / 10, 1);
+    size_t operations = min(records, benchOperations);
+    populateBenchStore(records, users);
+    mt19937 rng(records);
+
+    report.pass(records, "save users", users, timePass([] { saveUsers(); }));
+    report.pass(records, "save products", records, timePass([] { saveProducts(); }));
+    report.pass(records, "save orders", records, timePass([] { saveOrders(); }));
+    userMap.clear();
+    report.pass(records, "load users", users, timePass([] { loadUsers(); }));
+    report.pass(records, "load products", records, timePass([] { loadProducts(); }));
+    orderStore.clear();
+    report.pass(records, "load orders", records, timePass([] { loadOrders(); }));
+
+    BenchTimer lookups(operations);
+    Product product = Product();
+    for (size_t i = 0; i < operations; i++) {
+        int id = 1 + rng() % records;
+        lookups.time([&] { catalog.findById(id, product); });
+    }
+    report.latencies(records, "lookup", lookups);
+
+    // Browsers share the catalog version without locking, so throughput
+    // should grow with the thread count
+    vector<unsigned> browserCounts = {1};
+    if (thread::hardware_concurrency() > 1) browserCounts.push_back(thread::hardware_concurrency());
+    for (unsigned threads : browserCounts) {
+        report.pass(records, "browse x" + to_string(threads), threads * operations, timePass([&] {
+            vector<thread> browsers;
+            for (unsigned t = 0; t < threads; t++) {
+                browsers.emplace_back([&, t] {
+                    mt19937 pages(t);
+                    vector<Product> rows;
+                    for (size_t i = 0; i < operations; i++) {
+                        catalog.page(SORT_BY_NAME, pages() % records, productPageSize, rows);
+                    }
+                });
+            }
+            for (thread& browser : browsers) browser.join();
+        }));
+    }
+
+    BenchTimer cartAdds(operations);
+    vector<CartItem> cart;
+    cart.reserve(8);
+    for (size_t i = 0; i < operations; i++) {
+        int id = 1 + rng() % records;
+        cartAdds.time([&] { checkoutEngine.addToCart(cart, id, 1); });
+        if (cart.size() == 8) checkoutEngine.releaseCart(cart);
+    }
+    checkoutEngine.releaseCart(cart);
+    report.latencies(records, "cart add", cartAdds);
+
+    BenchTimer checkouts(operations);
+    Money total;
+    for (size_t i = 0; i < operations; i++) {
+        checkoutEngine.addToCart(cart, 1 + rng() % records, 1 + i % 3);
+        string username = benchUsername(rng() % users);
+        checkouts.time([&] { checkoutEngine.checkout(cart, username, total); });
+    }
+    report.latencies(records, "checkout", checkouts);
+
+    BenchTimer histories(operations);
+    vector<Order> history;
+    for (size_t i = 0; i < operations; i++) {
+        string username = benchUsername(rng() % users);
+        histories.time([&] { history = store.orderHistory(username); });
+    }
+    report.latencies(records, "order history", histories);
+
+    // Seeded orders with odd ids are the pending ones
+    BenchTimer orderDeliveries(min(operations, records / 2));
+    for (size_t i = 0; i < min(operations, records / 2); i++) {
+        long long id = 2 * static_cast<long long>(i) + 1;
+        orderDeliveries.time([&] { store.markOrderDelivered(id); });
+    }
+    report.latencies(records, "deliver order", orderDeliveries);
+
+    BenchTimer deliveries(min(operations, users));
+    for (size_t i = 0; i < min(operations, users); i++) {
+        string username = benchUsername(i);
+        deliveries.time([&] { store.markDelivered(username); });
+    }
+    report.latencies(records, "mark delivered", deliveries);
+}
+
+void removeBenchFiles() {
+    const char* files[] = {adminFile, userFile, ordersFile, productsFile, ordersLogFile, ordersCompactingLogFile,
+                           usersBinFile, productsBinFile, ordersBinFile, ledgerFile, metricsFile};
+    for (const char* file : files) {
+        for (const char* suffix : {"", ".bak", ".tmp"}) {
+            remove((string(file) + suffix).c_str());
+        }
+    }
+}
+
+// Makes the scratch directory the working directory, with an empty data/ in it.
+// Shared with the load generator.
+bool enterBenchDirectory() {
+    #ifdef _WIN32
+    _mkdir(benchDirectory);
+    bool entered = _chdir(benchDirectory) == 0;
+    #else
+    mkdir(benchDirectory, 0777);
+    bool entered = chdir(benchDirectory) == 0;
+    #endif
+    if (!entered) {
+        UI::printError(string("Cannot enter ") + benchDirectory);
+        return false;
+    }
+    ensureDataDirectoryExists();
+    removeBenchFiles();  // Left over from an interrupted run
+    return true;
+}
+
+// Resolves a command-line path against the starting directory, so it still
+// names the same file once the bench directory is entered
+string absolutePath(const char* path) {
+    #ifdef _WIN32
+    char full[_MAX_PATH];
+    return _fullpath(full, path, sizeof(full)) != NULL ? string(full) : string(path);
+    #else
+    char cwd[4096];
+    if (path[0] == '/' || getcwd(cwd, sizeof(cwd)) == NULL) return path;
+    return string(cwd) + "/" + path;
+    #endif
+}
+
+void leaveBenchDirectory() {
+    removeBenchFiles();
+    #ifdef _WIN32
+    _rmdir("data");
+    _chdir("..");
+    _rmdir(benchDirectory);
+    #else
+    rmdir("data");
+    if (chdir("..") == 0) rmdir(benchDirectory);
+    #endif
+}
+
+int runBenchmarks(size_t maxRecords) {
+    if (!enterBenchDirectory()) return 1;
+    orderJournal.open();
+    ledger.open(Money::fromCents(0));
+
+    BenchReport report;
+    for (size_t records = 1000; records <= max<size_t>(maxRecords, 1000); records *= 10) {
+        runBenchScale(records, report);
+    }
+
+    orderJournal.close();
+    ledger.close();
+    leaveBenchDirectory();
+    return 0;
+}
+
+
+// Scripted Mode - drives the store from a command file without any prompts
+//
+// One command per line, '#' starts a comment:
+//   register <user> <password> <email>     login <user> <password>
+//   admin <password>                       logout
+//   add-product <price> <quantity> <name>  products
+//   page <number> [id|name|price]          search <text>
+//   search-prefix <text>                   add <product id> <quantity>
+//   checkout                               history
+//   orders [Pending|Delivered]             deliver <user>
+//   report [count]                         sales [min] [max] [pending|delivered]
+//   balance                                deposit <amount>
+//   withdraw <amount>                      fulfillment
+//   wait <milliseconds>                    metrics
+//   deliver-order <order id>
+//   import <products|users|orders> <file.csv|file.json>
+//   export <products|users|orders> <file.csv|file.json>
+
+// Runs one import or export; empty on success, otherwise the reason it failed.
+// Shared by the import/export script commands and the --import/--export flags.
+string transferBulkData(const string& direction, const string& kind, const string& path) {
+    if (path.empty()) return "usage: " + direction + " <products|users|orders> <file.csv|file.json>";
+    if (direction == "export") {
+        size_t rows = 0;
+        StoreResult result;
+        if (kind == "products") result = store.exportProducts(path, rows);
+        else if (kind == "users") result = store.exportUsers(path, rows);
+        else if (kind == "orders") result = store.exportOrders(path, rows);
+        else return "unknown data set " + kind;
+        if (result != STORE_OK) return describe(result);
+        cout << "ok exported " << rows << " " << kind << " to " << path << endl;
+        return "";
+    }
+
+    BulkReport report;
+    StoreResult result;
+    if (kind == "products") result = store.importProducts(path, report);
+    else if (kind == "users") result = store.importUsers(path, report);
+    else if (kind == "orders") result = store.importOrders(path, report);
+    else return "unknown data set " + kind;
+
+    for (const string& error : report.errors) {
+        cout << "rejected " << error << endl;
+    }
+    if (result != STORE_OK) return describe(result);
+    cout << "ok imported " << report.imported << " of " << report.records << " " << kind << endl;
+    return "";
+}
+
+class ScriptRunner {
+public:
+    explicit ScriptRunner(ostream& out = cout) : out(out), isAdmin(false), failures(0) {}
+
+    // Returns the number of commands that failed
+    int run(istream& in) {
+        string line;
+        int lineNumber = 0;
+        while (getline(in, line)) {
+            lineNumber++;
+            size_t start = line.find_first_not_of(" \t\r");
+            if (start == string::npos || line[start] == '#') continue;
+
+            string command;
+            string error = execute(line, command);
+            if (!error.empty()) {
+                failures++;
+                out << "error line " << lineNumber << " (" << command << "): " << error << endl;
+            }
+        }
+        return failures;
+    }
+
+    // Runs one command line and reports its first word in `command`; empty
+    // on success, otherwise the reason it failed
+    string execute(const string& line, string& command) {
+        istringstream args(line);
+        args >> command;
+        return execute(command, args);
+    }
+
+private:
+    // Empty on success, otherwise the reason the command failed
+    string execute(const string& command, istringstream& args) {
+        if (command == "register") {
+            string username, password, email;
+            args >> username >> password >> email;
+            return check(store.registerUser(username, password, email), "registered " + username);
+        }
+        if (command == "login") {
+            string username, password;
+            args >> username >> password;
+            StoreResult result = store.login(username, password);
+            if (result == STORE_OK) {
+                currentUser = username;
+                isAdmin = false;
+            }
+            return check(result, "logged in as " + username);
+        }
+        if (command == "admin") {
+            string password;
+            args >> password;
+            StoreResult result = store.adminLogin(password);
+            if (result == STORE_OK) {
+                currentUser.clear();
+                isAdmin = true;
+            }
+            return check(result, "logged in as admin");
+        }
+        if (command == "logout") {
+            currentUser.clear();
+            isAdmin = false;
+            out << "ok logged out" << endl;
+            return "";
+        }
+        if (command == "products") {
+            // Copied first, so a slow reader of `out` never holds a catalog version
+            vector<Product> products = catalog.snapshot();
+            for (const Product& product : products) {
+                out << product.id << '\t' << product.name << '\t'
+                     << product.price << '\t' << product.quantity << '\n';
+            }
+            out << "ok " << products.size() << " products" << endl;
+            return "";
+        }
+        if (command == "page") {
+            size_t number = 0;
+            string key = "id";
+            if (!(args >> number) || number == 0) return "usage: page <number> [id|name|price]";
+            args >> key;
+            ProductSort sort = key == "name" ? SORT_BY_NAME : key == "price" ? SORT_BY_PRICE : SORT_BY_ID;
+            vector<Product> rows;
+            store.productPage(sort, (number - 1) * productPageSize, productPageSize, rows);
+            for (const Product& product : rows) {
+                out << product.id << '\t' << product.name << '\t'
+                     << product.price << '\t' << product.quantity << '\n';
+            }
+            out << "ok page " << number << ": " << rows.size() << " of " << store.productCount() << " products" << endl;
+            return "";
+        }
+        if (command == "search" || command == "search-prefix") {
+            ProductQuery query;
+            getline(args >> ws, query.text);
+            query.prefixOnly = command == "search-prefix";
+            query.limit = 0;
+            vector<Product> results = store.searchProducts(query);
+            for (const Product& product : results) {
+                out << product.id << '\t' << product.name << '\t'
+                     << product.price << '\t' << product.quantity << '\n';
+            }
+            out << "ok " << results.size() << " matches" << endl;
+            return "";
+        }
+        if (command == "add-product") {
+            if (!isAdmin) return "admin login required";
+            Money price;
+            int quantity;
+            string name;
+            if (!(args >> price >> quantity)) return "usage: add-product <price> <quantity> <name>";
+            getline(args >> ws, name);
+            int productId;
+            return check(store.addProduct(name, price, quantity, &productId),
+                         "added product " + name);
+        }
+        if (command == "add") {
+            if (currentUser.empty()) return "user login required";
+            int productId, quantity;
+            if (!(args >> productId >> quantity)) return "usage: add <product id> <quantity>";
+            return check(store.addToCart(currentUser, productId, quantity), "added to cart");
+        }
+        if (command == "checkout") {
+            if (currentUser.empty()) return "user login required";
+            Money total;
+            StoreResult result = store.checkout(currentUser, total);
+            return check(result, "checked out, total " + total.str());
+        }
+        if (command == "history") {
+            if (currentUser.empty()) return "user login required";
+            return printOrders(store.orderHistory(currentUser));
+        }
+        if (command == "orders") {
+            if (!isAdmin) return "admin login required";
+            string status;
+            args >> status;
+            return printOrders(store.orders(status));
+        }
+        if (command == "deliver") {
+            if (!isAdmin) return "admin login required";
+            string username;
+            args >> username;
+            return check(store.markDelivered(username), "delivered orders of " + username);
+        }
+        if (command == "deliver-order") {
+            if (!isAdmin) return "admin login required";
+            long long id = 0;
+            if (!(args >> id)) return "usage: deliver-order <order id>";
+            return check(store.markOrderDelivered(id), "delivered order " + to_string(id));
+        }
+        if (command == "report") {
+            if (!isAdmin) return "admin login required";
+            size_t count = 5;
+            args >> count;
+            printTotals("total", store.salesTotals());
+            for (const SalesRanking& ranking : store.topProducts(count)) {
+                printTotals("product " + ranking.key, ranking.totals);
+            }
+            for (const SalesRanking& ranking : store.topCustomers(count)) {
+                printTotals("customer " + ranking.key, ranking.totals);
+            }
+            out << "ok report" << endl;
+            return "";
+        }
+        if (command == "sales") {
+            if (!isAdmin) return "admin login required";
+            SalesQuery query;
+            string word;
+            for (int amounts = 0; args >> word; ) {
+                Money amount;
+                if (word == "pending") {
+                    query.status = SALES_PENDING;
+                } else if (word == "delivered") {
+                    query.status = SALES_DELIVERED;
+                } else if (Money::parse(word, amount) && amounts < 2) {
+                    (amounts++ == 0 ? query.minCents : query.maxCents) = amount.cents;
+                } else {
+                    return "usage: sales [min] [max] [pending|delivered]";
+                }
+            }
+            printTotals("ok sales", store.scanSales(query));
+            return "";
+        }
+        if (command == "import" || command == "export") {
+            if (!isAdmin) return "admin login required";
+            string kind, path;
+            args >> kind;
+            getline(args >> ws, path);
+            return transferBulkData(command, kind, path);
+        }
+        if (command == "fulfillment") {
+            if (!isAdmin) return "admin login required";
+            static const char* tierNames[] = {"premium", "standard"};
+            for (int tier = 0; tier < FulfillmentCenter::TIERS; tier++) {
+                FulfillmentStats stats = fulfillmentCenter.stats(static_cast<FulfillmentCenter::Tier>(tier));
+                out << tierNames[tier] << '\t' << stats.delivered << " delivered\t"
+                     << stats.averageMicroseconds << " us average\t" << stats.maxMicroseconds << " us max\n";
+            }
+            out << "ok fulfillment " << (fulfillmentCenter.running() ? "running" : "off") << endl;
+            return "";
+        }
+        if (command == "metrics") {
+            if (!isAdmin) return "admin login required";
+            out << formatMetrics(metrics.snapshot()) << "ok metrics" << endl;
+            return "";
+        }
+        if (command == "wait") {
+            int milliseconds = 0;
+            args >> milliseconds;
+            this_thread::sleep_for(chrono::milliseconds(milliseconds));
+            return "";
+        }
+        if (command == "balance") {
+            if (!isAdmin) return "admin login required";
+            out << "ok balance " << store.balance() << endl;
+            return "";
+        }
+        if (command == "deposit" || command == "withdraw") {
+            if (!isAdmin) return "admin login required";
+            Money amount = Money::fromCents(0);
+            args >> amount;
+            StoreResult result = command == "deposit" ? store.deposit(amount) : store.withdraw(amount);
+            return check(result, command + " done, balance " + store.balance().str());
+        }
+        return "unknown command";
+    }
+
+    string check(StoreResult result, const string& success) {
+        if (result != STORE_OK) return describe(result);
+        out << "ok " << success << endl;
+        return "";
+    }
+
+    string printOrders(const vector<Order>& orders) {
+        for (const Order& order : orders) {
+            out << order.id << '\t' << order.username << '\t' << order.productName << '\t' << order.quantity << '\t'
+                 << order.totalAmount << '\t' << order.status << '\n';
+        }
+        out << "ok " << orders.size() << " orders" << endl;
+        return "";
+    }
+
+    void printTotals(const string& label, const SalesTotals& totals) {
+        out << label << '\t' << totals.orders << " orders\t" << totals.units << " units\t"
+             << Money::fromCents(totals.pendingCents) << " pending\t"
+             << Money::fromCents(totals.deliveredCents) << " delivered" << endl;
+    }
+
+    ostream& out;
+    string currentUser;
+    bool isAdmin;
+    int failures;
+};
+
+
+// UI Components
+
+void displayMenu(const vector<string>& options, const string& title = "MENU") {
+    int width = 40;
+    cout << "+" << string(width, '-') << "+" << endl;
+    cout << "|" << UI::BOLD << setw(width) << left << ("  " + title) << UI::RESET << "|" << endl;
+    cout << "+" << string(width, '-') << "+" << endl;
+    
+    for (size_t i = 0; i < options.size(); i++) {
+        cout << "| " << UI::BOLD << setw(2) << left << (to_string(i+1) + ".") 
+             << UI::RESET << setw(width-3) << options[i] << "|" << endl;
+    }
+    
+    cout << "+" << string(width, '-') << "+" << endl;
+    cout << UI::BOLD << "Enter your choice: " << UI::RESET;
+}
+
+// Formats product rows into one reusable buffer and writes each table with a
+// single write, instead of a chain of stream insertions per row
+class ProductTableRenderer {
+public:
+    void render(const vector<Product>& rows, const string& caption = "") {
+        buffer.clear();
+        if (!caption.empty()) {
+            buffer += UI::BOLD + caption + UI::RESET + "\n";
+        }
+        buffer += border;
+        append("| %-4s | %-20s | %-9s | %-9s |\n", "ID", "Name", "Price", "Quantity");
+        buffer += border;
+        for (const Product& product : rows) {
+            char price[32];
+            snprintf(price, sizeof(price), "$%s", product.price.str().c_str());
+            append("| %s%-4d%s | %-20s | %-9s | %-9d |\n", UI::BOLD.c_str(), product.id,
+                   UI::RESET.c_str(), product.name, price, product.quantity);
+        }
+        buffer += border;
+        UI::writeBlock(buffer);
+    }
+
+private:
+    template <typename... Args>
+    void append(const char* format, Args... args) {
+        int length = snprintf(line, sizeof(line), format, args...);
+        if (length > 0) buffer.append(line, min<size_t>(length, sizeof(line) - 1));
+    }
+
+    const string border = "+------+----------------------+-----------+-----------+\n";
+    string buffer;
+    char line[256];
+};
+
+// Pages through the catalog; returns when the user quits the browser
+void browseProducts() {
+    static const char* sortNames[] = {"ID", "Name", "Price"};
+    ProductTableRenderer renderer;
+    vector<Product> rows;
+    ProductSort sort = SORT_BY_ID;
+    size_t pageSize = productPageSize;
+    size_t offset = 0;
+
+    while (true) {
+        size_t total = store.productCount();
+        if (total == 0) {
+            UI::printWarning("No products available!");
+            return;
+        }
+        if (offset >= total) offset = (total - 1) / pageSize * pageSize;
+
+        store.productPage(sort, offset, pageSize, rows);
+        renderer.render(rows, "Page " + to_string(offset / pageSize + 1) + " of " +
+                              to_string((total + pageSize - 1) / pageSize) + "  (" + to_string(total) +
+                              " products, sorted by " + sortNames[sort] + ")");
+
+        string command = getInput("[n]ext [p]revious [s]ort [q]uit: ");
+        char key = command.empty() ? 'n' : tolower(command[0]);
+        if (key == 'q') return;
+        if (key == 'n' && offset + pageSize < total) offset += pageSize;
+        if (key == 'p') offset = offset >= pageSize ? offset - pageSize : 0;
+        if (key == 's') {
+            sort = static_cast<ProductSort>((sort + 1) % 3);
+            offset = 0;
+        }
+    }
+}
+
+void displayCart(const vector<CartItem>& cart) {
+    if (cart.empty()) {
+        UI::printWarning("Your cart is empty!");
+        return;
+    }
+
+    Money total = Money::fromCents(0);
+    
+    cout << UI::YELLOW << UI::BOLD << "Your Shopping Cart" << UI::RESET << endl;
+    cout << "+------------------------+-------+-----------+" << endl;
+    cout << "| " << left << setw(24) << "Product" 
+         << "| " << setw(5) << "Qty" 
+         << "| " << setw(9) << "Subtotal" << "|" << endl;
+    cout << "+------------------------+-------+-----------+" << endl;
+    
+    for (const auto& item : cart) {
+        Money subtotal = item.price * item.quantity;
+        Product product = Product();
+        catalog.findById(item.productId, product);
+        cout << "| " << left << setw(24) << product.name 
+             << "| " << setw(5) << item.quantity 
+             << "| " << setw(9) << "$" + subtotal.str() 
+             << "|" << endl;
+        total += subtotal;
+    }
+    
+    cout << "+------------------------+-------+-----------+" << endl;
+    cout << "| " << left << setw(31) << "Total:" 
+         << " $" << setw(6) << total << "|" << endl;
+    cout << "+------------------------+-------+-----------+" << endl;
+}
+
+
+// Core Functions
+
+void adminLogin();
+void userLogin();
+void userRegistration();
+void adminMenu();
+void userMenu(const string& username);
+void addProduct();
+void salesReport();
+void metricsReport();
+void processOrder(const string& username);
+
+
+// Main Application
+
+// Rewrites every data file in the other format; the journal tail is folded in
+int convertSnapshots(bool toBinary) {
+    binarySnapshots = !toBinary;
+    loadUsers();
+    loadProducts();
+    loadOrders();
+
+    binarySnapshots = toBinary;
+    saveUsers();
+    saveProducts();
+    saveOrders();
+
+    UI::printSuccess(string("Converted data files to ") + (toBinary ? "binary" : "text") + " snapshots.");
+    return 0;
+}
+
+// data/config.txt holds key=value lines; the environment and flags override it
+void loadConfig() {
+    ifstream in(configFile);
+    string line;
+    while (getline(in, line)) {
+        size_t equals = line.find('=');
+        if (line.empty() || line[0] == '#' || equals == string::npos) continue;
+        string key = line.substr(0, equals);
+        string value = line.substr(equals + 1);
+        if (key == "fast_mode") {
+            UI::fastMode = (value == "1" || value == "true");
+        } else if (key == "page_size") {
+            productPageSize = max(1, atoi(value.c_str()));
+        } else if (key == "fulfillment_workers") {
+            fulfillmentWorkers = max(0, atoi(value.c_str()));
+        } else if (key == "fulfillment_ship_ms") {
+            fulfillmentShipMilliseconds = max(0, atoi(value.c_str()));
+        } else if (key == "password_iterations") {
+            passwordIterations = max(1, atoi(value.c_str()));
+        } else if (key == "password_hash_threads") {
+            passwordHashThreads = max(1, atoi(value.c_str()));
+        } else if (key == "cart_timeout_seconds") {
+            cartTimeoutSeconds = max(1, atoi(value.c_str()));
+        } else if (key == "product_flush_ms") {
+            productFlushMilliseconds = max(1, atoi(value.c_str()));
+        } else if (key == "product_flush_threshold") {
+            productFlushThreshold = max(1, atoi(value.c_str()));
+        } else if (key == "checksum_footers") {
+            checksumFooters = (value == "1" || value == "true");
+        } else if (key == "metrics") {
+            metricsEnabled = (value == "1" || value == "true");
+        } else if (key == "metrics_dump_seconds") {
+            metricsDumpSeconds = max(0, atoi(value.c_str()));
+        }
+    }
+
+    const char* fast = getenv("ECOMMERCE_FAST");
+    if (fast != NULL) {
+        UI::fastMode = strcmp(fast, "0") != 0 && strcmp(fast, "false") != 0;
+    }
+}
+
+// Returns reserved cart stock, flushes the catalog and folds the order journal into the snapshot
+void shutdownStore() {
+    store.shutdown();
+    fulfillmentCenter.stop();
+    productPersistence.stop();
+    if (orderJournal.hasPendingRecords()) {
+        saveOrders();
+    }
+    orderJournal.close();
+    ledger.close();
+    metricsExporter.stop();
+}
+
+// Load Generator - --loadgen [shoppers] [seconds] [threads] lets virtual shoppers
+// and admins loose on a scratch store; --replay <file> [threads] runs a
+// recorded load again
+//
+// Every action is a script command (see Scripted Mode) run through its own
+// ScriptRunner, so a session behaves exactly like a scripted one. With
+// --record <file> the commands are written out as
+//   <session>\t<command>
+// under a "# loadgen products=<count> shoppers=<count>" header that says how
+// the scratch store was seeded. A replay runs each session's commands in
+// order, the sessions themselves concurrently. Both modes report throughput
+// and tail latency per command.
+//
+// Nine in ten shoppers are returning customers who already have an account;
+// the rest sign up first.
+
+const char loadAdminPassword[] = "admin123";
+const char loadShopperPassword[] = "loadpass1";
+const size_t loadCatalogSize = 1000;
+const int loadStock = 100000;  // Per product, enough that stock runs out only for hot items
+
+struct LoadSession {
+    explicit LoadSession(int id) : id(id), discard(NULL), runner(discard), stage(0), cartLines(0),
+                                   lastFailed(false), rng(id), next(0) {}
+
+    int id;
+    ostream discard;     // Command output is thrown away
+    ScriptRunner runner;
+    int stage;           // Generated shoppers: 0 new, 1 registered, 2 logged in
+    int cartLines;       // Generated shoppers: add commands since the last checkout
+    bool lastFailed;
+    mt19937 rng;
+    vector<string> script;  // Replayed sessions: the recorded commands
+    size_t next;
+};
+
+struct LoadStats {
+    map<string, vector<long long>> samples;  // Nanoseconds per call, by command
+    map<string, long long> errors;
+
+    void merge(LoadStats& other) {
+        for (auto& pair : other.samples) {
+            vector<long long>& into = samples[pair.first];
+            into.insert(into.end(), pair.second.begin(), pair.second.end());
+        }
+        for (const auto& pair : other.errors) errors[pair.first] += pair.second;
+    }
+};
+
+bool returningShopper(int id) {
+    return id % 10 != 9;
+}
+
+// The next command of a generated session: shoppers register, log in, browse,
+// fill carts and check out; admins deliver the orders of shoppers who checked
+// out (passed along in `checkedOut`) and read reports
+string nextLoadCommand(LoadSession& session, int shoppers, MpmcRing<int>& checkedOut) {
+    mt19937& rng = session.rng;
+    if (session.id >= shoppers) {
+        int shopper;
+        if (session.stage == 0 || session.lastFailed) {
+            session.stage = 2;
+            return string("admin ") + loadAdminPassword;
+        }
+        if (checkedOut.pop(shopper)) return "deliver " + benchUsername(shopper);
+        return rng() % 10 == 0 ? "report 5" : "balance";
+    }
+
+    string username = benchUsername(session.id);
+    if (session.stage == 0 && !returningShopper(session.id)) {
+        session.stage = 1;
+        return "register " + username + " " + loadShopperPassword + " " + username + "@load.test";
+    }
+    if (session.stage < 2 || session.lastFailed) {
+        session.stage = 2;
+        return string("login ") + username + " " + loadShopperPassword;
+    }
+
+    unsigned roll = rng() % 100;
+    if (roll < 30) {
+        size_t pages = (loadCatalogSize + productPageSize - 1) / productPageSize;
+        static const char* sorts[] = {"id", "name", "price"};
+        return "page " + to_string(1 + rng() % pages) + " " + sorts[rng() % 3];
+    }
+    if (roll < 40) return "search-prefix Item" + to_string(1 + rng() % 99);
+    if (roll < 75 || (roll < 90 && session.cartLines == 0)) {
+        // Skewed towards low ids, so a few products are hot
+        size_t id = 1 + (rng() % loadCatalogSize) * (rng() % loadCatalogSize) / loadCatalogSize;
+        session.cartLines++;
+        return "add " + to_string(id) + " " + to_string(1 + rng() % 3);
+    }
+    if (roll < 90) {
+        session.cartLines = 0;
+        checkedOut.push(session.id);  // Full ring: that delivery is left to a later run
+        return "checkout";
+    }
+    if (roll < 97) return "history";
+    session.stage = 1;
+    return "logout";
+}
+
+// Round-robins over `sessions` until `nextCommand` has nothing more for any of them
+template <typename NextCommand>
+void runLoadSessions(const vector<LoadSession*>& sessions, NextCommand nextCommand, LoadStats& stats,
+                     ostringstream* recording) {
+    string line, command;
+    for (bool active = true; active;) {
+        active = false;
+        for (LoadSession* session : sessions) {
+            if (!nextCommand(*session, line)) continue;
+            active = true;
+            chrono::steady_clock::time_point start = chrono::steady_clock::now();
+            string error = session->runner.execute(line, command);
+            long long elapsed = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+            stats.samples[command].push_back(elapsed);
+            session->lastFailed = !error.empty();
+            if (session->lastFailed) stats.errors[command]++;
+            if (recording != NULL) *recording << session->id << '\t' << line << '\n';
+        }
+    }
+}
+
+// Spreads the sessions over `threads` workers and reports once all are done
+template <typename NextCommand>
+void runLoad(deque<LoadSession>& sessions, int threads, NextCommand nextCommand, int shoppers,
+             const char* recordFile) {
+    vector<LoadStats> stats(threads);
+    vector<ostringstream> recordings(recordFile != NULL ? threads : 0);
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    vector<thread> workers;
+    for (int t = 0; t < threads; t++) {
+        workers.emplace_back([&, t] {
+            vector<LoadSession*> mine;
+            for (size_t i = t; i < sessions.size(); i += threads) mine.push_back(&sessions[i]);
+            runLoadSessions(mine, nextCommand, stats[t], recordings.empty() ? NULL : &recordings[t]);
+        });
+    }
+    for (thread& worker : workers) worker.join();
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    if (recordFile != NULL) {
+        AtomicFileWriter file(recordFile);
+        file.write("# loadgen products=" + to_string(loadCatalogSize) + " shoppers=" + to_string(shoppers) + "\n");
+        for (const ostringstream& recording : recordings) file.write(recording.str());
+        if (!file.commit()) UI::printError(string("Cannot write ") + recordFile);
+    }
+
+    for (int t = 1; t < threads; t++) stats[0].merge(stats[t]);
+    cout << sessions.size() << " sessions on " << threads << " threads for " << fixed << setprecision(1)
+         << seconds << " s\n";
+    cout << left << setw(16) << "Command" << right << setw(10) << "Ops" << setw(10) << "Errors" << setw(12) << "Ops/s"
+         << setw(12) << "p50 us" << setw(12) << "p99 us" << setw(12) << "p99.9 us" << setw(12) << "Max us" << endl;
+    long long total = 0;
+    long long busy = 0;
+    long long authenticating = 0;  // Commands that check or hash a password
+    for (auto& pair : stats[0].samples) {
+        vector<long long>& samples = pair.second;
+        long long spent = 0;
+        for (long long sample : samples) spent += sample;
+        busy += spent;
+        if (pair.first == "login" || pair.first == "register" || pair.first == "admin") authenticating += spent;
+        sort(samples.begin(), samples.end());
+        auto quantile = [&](double q) { return samples[min(samples.size() - 1, (size_t)(q * samples.size()))] / 1000.0; };
+        total += samples.size();
+        cout << left << setw(16) << pair.first << right << setw(10) << samples.size()
+             << setw(10) << stats[0].errors[pair.first] << setprecision(0) << setw(12) << samples.size() / seconds
+             << setprecision(1) << setw(12) << quantile(0.5) << setw(12) << quantile(0.99)
+             << setw(12) << quantile(0.999) << setw(12) << samples.back() / 1000.0 << endl;
+    }
+    cout << left << setw(16) << "all" << right << setw(10) << total << setw(10) << "" << setprecision(0)
+         << setw(12) << total / seconds << endl;
+    cout << "Password checks (admin, login, register): " << setprecision(1)
+         << (busy > 0 ? 100.0 * authenticating / busy : 0.0) << "% of command time" << endl;
+}
+
+// A store in the scratch directory with the default admin, a seeded catalog
+// and accounts for the returning shoppers. Passwords get a token work factor,
+// so the run measures the store rather than PBKDF2.
+bool startLoadStore(size_t products, int shoppers) {
+    if (!enterBenchDirectory()) return false;
+    passwordIterations = 1;
+    AtomicFileWriter admin(adminFile, AtomicFileWriter::CHECKSUM_FOOTER);
+    admin.write(hashPassword(loadAdminPassword, passwordIterations) + "\n");
+    admin.commit();
+
+    string passwordHash = hashPassword(loadShopperPassword, passwordIterations);
+    for (int id = 0; id < shoppers; id++) {
+        if (!returningShopper(id)) continue;
+        User user = User();
+        string username = benchUsername(id);
+        strcpy(user.username, username.c_str());
+        strcpy(user.password, passwordHash.c_str());
+        strcpy(user.email, (username + "@load.test").c_str());
+        userMap[username] = user;
+    }
+    saveUsers();
+
+    vector<Product> items(products);
+    for (size_t i = 0; i < products; i++) {
+        items[i].id = (int)i + 1;
+        snprintf(items[i].name, sizeof(items[i].name), "Item%lu", (unsigned long)i + 1);
+        items[i].price = Money::fromCents(99 + (i * 37) % 5000);
+        items[i].quantity = loadStock;
+    }
+    addProductsToCatalog(items.data(), items.data() + products);
+
+    orderJournal.open();
+    ledger.open(Money::fromCents(0));
+    productPersistence.start();
+    metricsExporter.start();
+    store.startSessions();
+    fulfillmentCenter.start(fulfillmentWorkers);
+    return true;
+}
+
+int runLoadGenerator(int shoppers, int seconds, int threads, const char* recordFile) {
+    string recordPath = recordFile != NULL ? absolutePath(recordFile) : "";
+    if (!startLoadStore(loadCatalogSize, shoppers)) return 1;
+    deque<LoadSession> sessions;
+    int admins = max(1, shoppers / 50);
+    for (int id = 0; id < shoppers + admins; id++) sessions.emplace_back(id);
+
+    MpmcRing<int> checkedOut;
+    chrono::steady_clock::time_point deadline = chrono::steady_clock::now() + chrono::seconds(seconds);
+    runLoad(sessions, threads, [&](LoadSession& session, string& line) {
+        if (chrono::steady_clock::now() >= deadline) return false;
+        line = nextLoadCommand(session, shoppers, checkedOut);
+        return true;
+    }, shoppers, recordFile != NULL ? recordPath.c_str() : NULL);
+
+    shutdownStore();
+    leaveBenchDirectory();
+    return 0;
+}
+
+int runReplay(const char* replayFile, int threads) {
+    ifstream in(replayFile);
+    if (!in) {
+        UI::printError(string("Cannot open ") + replayFile);
+        return 1;
+    }
+    size_t products = loadCatalogSize;
+    int shoppers = 0;
+    map<int, vector<string>> scripts;
+    string line;
+    while (getline(in, line)) {
+        if (line.compare(0, 9, "# loadgen") == 0) {
+            size_t at = line.find("products=");
+            if (at != string::npos) products = strtoul(line.c_str() + at + 9, NULL, 10);
+            at = line.find("shoppers=");
+            if (at != string::npos) shoppers = atoi(line.c_str() + at + 9);
+            continue;
+        }
+        size_t tab = line.find('\t');
+        if (line.empty() || line[0] == '#' || tab == string::npos) continue;
+        scripts[atoi(line.c_str())].push_back(line.substr(tab + 1));
+    }
+
+    if (!startLoadStore(products, shoppers)) return 1;
+    deque<LoadSession> sessions;
+    for (auto& pair : scripts) {
+        sessions.emplace_back(pair.first);
+        sessions.back().script.swap(pair.second);
+    }
+
+    runLoad(sessions, threads, [](LoadSession& session, string& command) {
+        if (session.next == session.script.size()) return false;
+        command = session.script[session.next++];
+        return true;
+    }, shoppers, NULL);
+
+    shutdownStore();
+    leaveBenchDirectory();
+    return 0;
+}
+
+// HTTP Server - --serve [port] [workers] puts a small JSON API in front of the
+// Store on 127.0.0.1
+//
+// One event-loop thread owns every socket: it accepts connections, reads and
+// parses requests and writes responses, all non-blocking through epoll. Each
+// parsed request goes to a pool of workers that call the Store (logins hash
+// passwords, checkouts take the order book lock); a finished response comes
+// back through a queue and an eventfd that wakes the loop. Connections are
+// HTTP/1.1 keep-alive with one request in flight at a time, so pipelined
+// requests are answered in order.
+//
+//   POST /register                {"username", "password", "email"}
+//   POST /login                   {"username", "password"}  -> {"token"}
+//   POST /admin                   {"password"}              -> {"token"}
+//   POST /logout
+//   GET  /products?page=N&sort=id|name|price
+//   POST /products                {"name", "price", "quantity"}  (admin)
+//   GET  /search?q=text&prefix=1
+//   GET  /cart
+//   POST /cart                    {"product_id", "quantity"}
+//   POST /checkout
+//   GET  /orders?status=Pending   a customer's delivered orders, or every order for the admin
+//   POST /orders/<id>/deliver     (admin)
+//   GET  /metrics                 Prometheus text
+//
+// Everything except register, login, admin, products, search and metrics needs
+// an "Authorization: Bearer <token>" header from login or admin. Errors come
+// back as {"error": "<message>"} with a 4xx or 5xx status.
+
+#ifdef __linux__
+
+struct HttpRequest {
+    string method;
+    string path;
+    string query;  // After '?', still percent-encoded
+    string body;
+    string token;  // From "Authorization: Bearer <token>"
+    bool keepAlive;
+};
+
+struct HttpResponse {
+    int status;
+    string contentType;
+    string body;
+};
+
+const size_t httpMaxHeaderBytes = 16 * 1024;
+const size_t httpMaxBodyBytes = 1 << 20;
+
+enum HttpParse { HTTP_INCOMPLETE, HTTP_COMPLETE, HTTP_BAD_REQUEST, HTTP_TOO_LARGE };
+
+// Takes one request off the front of `buffer` once it has fully arrived
+HttpParse parseHttpRequest(string& buffer, HttpRequest& request) {
+    size_t headerEnd = buffer.find("\r\n\r\n");
+    if (headerEnd == string::npos) {
+        return buffer.size() > httpMaxHeaderBytes ? HTTP_TOO_LARGE : HTTP_INCOMPLETE;
+    }
+
+    istringstream head(buffer.substr(0, headerEnd));
+    string line, target, version;
+    getline(head, line);
+    istringstream requestLine(line);
+    if (!(requestLine >> request.method >> target >> version) || version.compare(0, 5, "HTTP/") != 0) {
+        return HTTP_BAD_REQUEST;
+    }
+    size_t question = target.find('?');
+    request.path = target.substr(0, question);
+    request.query = question == string::npos ? "" : target.substr(question + 1);
+    request.keepAlive = version != "HTTP/1.0";
+    request.token.clear();
+
+    size_t contentLength = 0;
+    while (getline(head, line)) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        size_t colon = line.find(':');
+        if (colon == string::npos) continue;
+        string name = line.substr(0, colon);
+        transform(name.begin(), name.end(), name.begin(), ::tolower);
+        size_t start = line.find_first_not_of(' ', colon + 1);
+        string value = start == string::npos ? "" : line.substr(start);
+
+        if (name == "content-length") {
+            if (value.empty() || value.find_first_not_of("0123456789") != string::npos) return HTTP_BAD_REQUEST;
+            contentLength = strtoull(value.c_str(), NULL, 10);
+            if (contentLength > httpMaxBodyBytes) return HTTP_TOO_LARGE;
+        } else if (name == "transfer-encoding") {
+            return HTTP_BAD_REQUEST;  // Chunked bodies are not supported
+        } else if (name == "connection") {
+            transform(value.begin(), value.end(), value.begin(), ::tolower);
+            if (value == "close") request.keepAlive = false;
+            if (value == "keep-alive") request.keepAlive = true;
+        } else if (name == "authorization" && value.compare(0, 7, "Bearer ") == 0) {
+            request.token = value.substr(7);
+        }
+    }
+
+    size_t total = headerEnd + 4 + contentLength;
+    if (buffer.size() < total) return HTTP_INCOMPLETE;
+    request.body = buffer.substr(headerEnd + 4, contentLength);
+    buffer.erase(0, total);
+    return HTTP_COMPLETE;
+}
+
+const char* httpReason(int status) {
+    switch (status) {
+        case 200: return "OK";
+        case 201: return "Created";
+        case 400: return "Bad Request";
+        case 401: return "Unauthorized";
+        case 403: return "Forbidden";
+        case 404: return "Not Found";
+        case 405: return "Method Not Allowed";
+        case 409: return "Conflict";
+        case 413: return "Payload Too Large";
+        case 500: return "Internal Server Error";
+    }
+    return "Unknown";
+}
+
+string formatHttpResponse(const HttpResponse& response, bool keepAlive) {
+    string text = "HTTP/1.1 " + to_string(response.status) + " " + httpReason(response.status) + "\r\n";
+    text += "Content-Type: " + response.contentType + "\r\n";
+    text += "Content-Length: " + to_string(response.body.size()) + "\r\n";
+    text += keepAlive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+    text += response.body;
+    return text;
+}
+
+string jsonString(const string& value) {
+    string out = "\"";
+    for (char c : value) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (c == '\n') {
+            out += "\\n";
+        } else if ((unsigned char)c < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            out += escaped;
+        } else {
+            out += c;
+        }
+    }
+    return out + "\"";
+}
+
+// Percent-decoded value of `name` in a query string, empty when absent
+string queryParameter(const string& query, const string& name) {
+    size_t start = 0;
+    while (start <= query.size()) {
+        size_t end = query.find('&', start);
+        if (end == string::npos) end = query.size();
+        size_t equals = query.find('=', start);
+        if (equals < end && query.compare(start, equals - start, name) == 0 && equals - start == name.size()) {
+            string value;
+            for (size_t i = equals + 1; i < end; i++) {
+                if (query[i] == '+') {
+                    value += ' ';
+                } else if (query[i] == '%' && i + 2 < end && isxdigit((unsigned char)query[i + 1]) &&
+                           isxdigit((unsigned char)query[i + 2])) {
+                    value += (char)strtol(query.substr(i + 1, 2).c_str(), NULL, 16);
+                    i += 2;
+                } else {
+                    value += query[i];
+                }
+            }
+            return value;
+        }
+        start = end + 1;
+    }
+    return "";
+}
+
+// Logged-in API clients, by bearer token. Tokens last until logout or restart.
+class ApiSessions {
+public:
+    struct Session {
+        string username;  // Empty for the admin
+        bool admin;
+    };
+
+    // 128 bits drawn from the OS for every token, like password salts, so one
+    // token says nothing about the next
+    string issue(const string& username, bool admin) {
+        lock_guard<mutex> guard(mtx);
+        uint8_t bytes[16];
+        for (size_t i = 0; i < sizeof(bytes); i += sizeof(uint32_t)) {
+            uint32_t word = uint32_t(device());
+            memcpy(bytes + i, &word, sizeof(word));
+        }
+        string token = toHex(bytes, sizeof(bytes));
+        sessions[token] = Session{username, admin};
+        return token;
+    }
+
+    bool find(const string& token, Session& session) {
+        lock_guard<mutex> guard(mtx);
+        auto it = sessions.find(token);
+        if (it == sessions.end()) return false;
+        session = it->second;
+        return true;
+    }
+
+    void revoke(const string& token) {
+        lock_guard<mutex> guard(mtx);
+        sessions.erase(token);
+    }
+
+private:
+    mutex mtx;
+    random_device device;
+    unordered_map<string, Session> sessions;
+};
+
+ApiSessions apiSessions;
+
+HttpResponse apiJson(int status, const string& body) {
+    return HttpResponse{status, "application/json", body + "\n"};
+}
+
+HttpResponse apiError(int status, const string& message) {
+    return apiJson(status, "{\"error\": " + jsonString(message) + "}");
+}
+
+HttpResponse apiResult(StoreResult result, const string& body = "{\"ok\": true}") {
+    switch (result) {
+        case STORE_OK: return apiJson(200, body);
+        case BAD_CREDENTIALS: return apiError(401, describe(result));
+        case PRODUCT_NOT_FOUND:
+        case ORDER_NOT_FOUND: return apiError(404, describe(result));
+        case USERNAME_TAKEN:
+        case OUT_OF_STOCK:
+        case EMPTY_CART:
+        case NO_PENDING_ORDERS:
+        case ORDER_NOT_PENDING:
+        case INSUFFICIENT_FUNDS: return apiError(409, describe(result));
+        case STORAGE_ERROR: return apiError(500, describe(result));
+        default: return apiError(400, describe(result));
+    }
+}
+
+// The body's fields in `names` order; missing fields are empty
+vector<string> jsonFields(const string& body, const vector<BulkColumn>& names) {
+    vector<string> fields(names.size());
+    parseJsonObject(body.data(), body.size(), names, fields);
+    return fields;
+}
+
+string productJson(const Product& product) {
+    return "{\"id\": " + to_string(product.id) + ", \"name\": " + jsonString(product.name) +
+           ", \"price\": " + product.price.str() + ", \"quantity\": " + to_string(product.quantity) + "}";
+}
+
+string productsJson(const vector<Product>& products) {
+    string out = "[";
+    for (size_t i = 0; i < products.size(); i++) {
+        out += (i > 0 ? ", " : "") + productJson(products[i]);
+    }
+    return out + "]";
+}
+
+string ordersJson(const vector<Order>& orders) {
+    string out = "[";
+    for (size_t i = 0; i < orders.size(); i++) {
+        const Order& order = orders[i];
+        out += (i > 0 ? ", {\"id\": " : "{\"id\": ") + to_string(order.id) +
+               ", \"username\": " + jsonString(order.username) +
+               ", \"product_id\": " + to_string(order.productId) +
+               ", \"product\": " + jsonString(order.productName) +
+               ", \"quantity\": " + to_string(order.quantity) +
+               ", \"total\": " + order.totalAmount.str() +
+               ", \"status\": " + jsonString(order.status) + "}";
+    }
+    return out + "]";
+}
+
+HttpResponse routeApiRequest(const HttpRequest& request) {
+    const string& method = request.method;
+    const string& path = request.path;
+    bool get = method == "GET", post = method == "POST";
+
+    if (path == "/metrics" && get) {
+        return HttpResponse{200, "text/plain; version=0.0.4", formatMetrics(metrics.snapshot())};
+    }
+    if (path == "/register" && post) {
+        vector<string> fields = jsonFields(request.body, {{"username", false}, {"password", false}, {"email", false}});
+        return apiResult(store.registerUser(fields[0], fields[1], fields[2]));
+    }
+    if (path == "/login" && post) {
+        vector<string> fields = jsonFields(request.body, {{"username", false}, {"password", false}});
+        StoreResult result = store.login(fields[0], fields[1]);
+        if (result != STORE_OK) return apiResult(result);
+        return apiJson(200, "{\"token\": " + jsonString(apiSessions.issue(fields[0], false)) + "}");
+    }
+    if (path == "/admin" && post) {
+        vector<string> fields = jsonFields(request.body, {{"password", false}});
+        StoreResult result = store.adminLogin(fields[0]);
+        if (result != STORE_OK) return apiResult(result);
+        return apiJson(200, "{\"token\": " + jsonString(apiSessions.issue("", true)) + "}");
+    }
+    if (path == "/products" && get) {
+        string number = queryParameter(request.query, "page");
+        string key = queryParameter(request.query, "sort");
+        size_t page = quantityValid(number) && stoi(number) > 0 ? stoi(number) : 1;
+        ProductSort sort = key == "name" ? SORT_BY_NAME : key == "price" ? SORT_BY_PRICE : SORT_BY_ID;
+        vector<Product> rows;
+        store.productPage(sort, (page - 1) * productPageSize, productPageSize, rows);
+        return apiJson(200, "{\"count\": " + to_string(store.productCount()) + ", \"page\": " + to_string(page) +
+                            ", \"products\": " + productsJson(rows) + "}");
+    }
+    if (path == "/search" && get) {
+        ProductQuery query;
+        query.text = queryParameter(request.query, "q");
+        query.prefixOnly = queryParameter(request.query, "prefix") == "1";
+        return apiJson(200, "{\"products\": " + productsJson(store.searchProducts(query)) + "}");
+    }
+
+    ApiSessions::Session session;
+    if (!apiSessions.find(request.token, session)) {
+        bool known = path == "/logout" || path == "/products" || path == "/cart" || path == "/checkout" ||
+                     path == "/orders" || path.compare(0, 8, "/orders/") == 0;
+        return known ? apiError(401, "login required") : apiError(404, "no such endpoint");
+    }
+
+    if (path == "/logout" && post) {
+        apiSessions.revoke(request.token);
+        return apiResult(STORE_OK);
+    }
+    if (path == "/products" && post) {
+        if (!session.admin) return apiError(403, "admin login required");
+        vector<string> fields = jsonFields(request.body, {{"name", false}, {"price", true}, {"quantity", true}});
+        if (!priceValid(fields[1])) return apiResult(INVALID_PRICE);
+        if (!quantityValid(fields[2])) return apiResult(INVALID_QUANTITY);
+        int productId = 0;
+        StoreResult result = store.addProduct(fields[0], toMoney(fields[1]), stoi(fields[2]), &productId);
+        return apiResult(result, "{\"id\": " + to_string(productId) + "}");
+    }
+    if (path == "/orders" && get) {
+        if (session.admin) {
+            return apiJson(200, "{\"orders\": " + ordersJson(store.orders(queryParameter(request.query, "status"))) + "}");
+        }
+        return apiJson(200, "{\"orders\": " + ordersJson(store.orderHistory(session.username)) + "}");
+    }
+    if (path.compare(0, 8, "/orders/") == 0 && post) {
+        if (!session.admin) return apiError(403, "admin login required");
+        size_t slash = path.find('/', 8);
+        string id = path.substr(8, slash == string::npos ? string::npos : slash - 8);
+        if (slash == string::npos || path.substr(slash) != "/deliver" || id.empty() ||
+            id.find_first_not_of("0123456789") != string::npos || id.size() > 18) {
+            return apiError(404, "no such endpoint");
+        }
+        return apiResult(store.markOrderDelivered(stoll(id)));
+    }
+
+    if (path == "/cart" || path == "/checkout") {
+        if (session.admin) return apiError(403, "customer login required");
+        if (path == "/cart" && get) {
+            string out = "{\"items\": [";
+            vector<CartItem> cart = store.cart(session.username);
+            for (size_t i = 0; i < cart.size(); i++) {
+                Product product = Product();
+                catalog.findById(cart[i].productId, product);
+                out += (i > 0 ? ", {\"product_id\": " : "{\"product_id\": ") + to_string(cart[i].productId) +
+                       ", \"name\": " + jsonString(product.name) + ", \"price\": " + cart[i].price.str() +
+                       ", \"quantity\": " + to_string(cart[i].quantity) + "}";
+            }
+            return apiJson(200, out + "]}");
+        }
+        if (path == "/cart" && post) {
+            vector<string> fields = jsonFields(request.body, {{"product_id", true}, {"quantity", true}});
+            if (!quantityValid(fields[0])) return apiResult(PRODUCT_NOT_FOUND);
+            if (!quantityValid(fields[1])) return apiResult(INVALID_QUANTITY);
+            return apiResult(store.addToCart(session.username, stoi(fields[0]), stoi(fields[1])));
+        }
+        if (path == "/checkout" && post) {
+            Money total;
+            StoreResult result = store.checkout(session.username, total);
+            return apiResult(result, "{\"total\": " + total.str() + "}");
+        }
+    }
+
+    bool known = path == "/register" || path == "/login" || path == "/admin" || path == "/logout" ||
+                 path == "/products" || path == "/search" || path == "/cart" || path == "/checkout" ||
+                 path == "/orders" || path == "/metrics";
+    return known ? apiError(405, "method not allowed") : apiError(404, "no such endpoint");
+}
+
+HttpResponse handleApiRequest(const HttpRequest& request) {
+    MetricTimer timer(METRIC_HTTP_REQUEST);
+    HttpResponse response = routeApiRequest(request);
+    if (response.status >= 400) countMetric(COUNTER_HTTP_ERRORS);
+    return response;
+}
+
+volatile sig_atomic_t serverStopRequested = 0;
+int serverWakeFd = -1;
+
+// SIGINT/SIGTERM: write() is async-signal-safe, so the loop can be woken from here
+void requestServerStop(int) {
+    serverStopRequested = 1;
+    uint64_t one = 1;
+    ssize_t ignored = write(serverWakeFd, &one, sizeof(one));
+    (void)ignored;
+}
+
+class HttpServer {
+public:
+    HttpServer() : listenFd(-1), epollFd(-1), wakeFd(-1), nextConnection(firstConnection), stopping(false) {}
+    HttpServer(const HttpServer&) = delete;
+    HttpServer& operator=(const HttpServer&) = delete;
+
+    ~HttpServer() { closeAll(); }
+
+    bool listen(int port) {
+        listenFd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        epollFd = epoll_create1(EPOLL_CLOEXEC);
+        wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (listenFd < 0 || epollFd < 0 || wakeFd < 0) return false;
+
+        int on = 1;
+        setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        sockaddr_in address = sockaddr_in();
+        address.sin_family = AF_INET;
+        address.sin_port = htons(port);
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (bind(listenFd, (sockaddr*)&address, sizeof(address)) != 0 || ::listen(listenFd, SOMAXCONN) != 0) {
+            return false;
+        }
+        return watch(listenFd, listenTag, EPOLLIN) && watch(wakeFd, wakeTag, EPOLLIN);
     }
-}
 
-void addProductToLinkedList(const Product& product) {
-    Product* newProduct = new Product;
-    newProduct->id = product.id;
-    strcpy(newProduct->name, product.name);
-    newProduct->price = product.price;
-    newProduct->quantity = product.quantity;
-    newProduct->next = NULL;
+    // Serves until SIGINT or SIGTERM, then lets in-flight requests finish
+    void run(int workerCount) {
+        serverWakeFd = wakeFd;
+        signal(SIGINT, requestServerStop);
+        signal(SIGTERM, requestServerStop);
+        for (int i = 0; i < workerCount; i++) {
+            workers.emplace_back(&HttpServer::workerLoop, this);
+        }
 
-    if (productHead == NULL) {
-        productHead = newProduct;
-    } else {
-        Product* current = productHead;
-        while (current->next != NULL) {
-            current = current->next;
+        epoll_event events[256];
+        while (!serverStopRequested) {
+            int ready = epoll_wait(epollFd, events, 256, -1);
+            if (ready < 0 && errno != EINTR) break;
+            for (int i = 0; i < ready; i++) {
+                uint64_t tag = events[i].data.u64;
+                if (tag == listenTag) {
+                    acceptAll();
+                } else if (tag == wakeTag) {
+                    uint64_t count;
+                    while (read(wakeFd, &count, sizeof(count)) > 0) {}
+                    deliverResponses();
+                } else {
+                    // A reset or fully closed socket cannot take a response either
+                    if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                        closeConnection(tag);
+                        continue;
+                    }
+                    if (events[i].events & (EPOLLIN | EPOLLRDHUP)) readFrom(tag);
+                    if (events[i].events & EPOLLOUT) flush(tag);
+                }
+            }
         }
-        current->next = newProduct;
-    }
-    
-    if (product.id >= nextProductId) {
-        nextProductId = product.id + 1;
-    }
-}
 
-void loadProducts() {
-    ifstream in(productsFile);
-    if (!in) return;
-    
-    // Clear existing list
-    Product* current = productHead;
-    while (current != NULL) {
-        Product* temp = current;
-        current = current->next;
-        delete temp;
+        {
+            lock_guard<mutex> guard(jobsMutex);
+            stopping = true;
+            jobsReady.notify_all();
+        }
+        for (thread& worker : workers) worker.join();
+        workers.clear();
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        serverWakeFd = -1;
     }
-    productHead = NULL;
 
-    Product temp;
-    while (in >> temp.id >> temp.name >> temp.price >> temp.quantity) {
-        addProductToLinkedList(temp);
-    }
-}
+private:
+    static const uint64_t listenTag = 0;
+    static const uint64_t wakeTag = 1;
+    static const uint64_t firstConnection = 2;
 
-void saveProducts() {
-    ofstream out(productsFile);
-    if (!out) {
-        UI::printError("Error saving products!");
-        return;
+    struct Connection {
+        int fd;
+        string in;
+        string out;
+        size_t sent;
+        bool busy;              // A request is with the workers or its response is being written
+        bool closeAfterWrite;
+        bool peerClosed;
+        bool writing;           // Waiting for EPOLLOUT
+    };
+
+    struct Job {
+        uint64_t connection;
+        HttpRequest request;
+    };
+
+    struct Done {
+        uint64_t connection;
+        string response;
+        bool keepAlive;
+    };
+
+    bool watch(int fd, uint64_t tag, uint32_t events) {
+        epoll_event event = epoll_event();
+        event.events = events;
+        event.data.u64 = tag;
+        return epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) == 0;
     }
-    
-    Product* current = productHead;
-    while (current != NULL) {
-        out << current->id << '\t' 
-            << current->name << '\t' 
-            << current->price << '\t' 
-            << current->quantity << '\n';
-        current = current->next;
+
+    void acceptAll() {
+        while (true) {
+            int fd = accept4(listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) return;  // EAGAIN, or out of descriptors until a connection closes
+            int on = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+            uint64_t id = nextConnection++;
+            if (!watch(fd, id, EPOLLIN | EPOLLRDHUP)) {
+                ::close(fd);
+                continue;
+            }
+            connections[id] = Connection{fd, "", "", 0, false, false, false, false};
+        }
     }
-}
 
-void loadOrders() {
-    ifstream in(ordersFile);
-    if (!in) return;
-    
-    Order order;
-    while (in >> order.username >> order.productName 
-           >> order.quantity >> order.totalAmount
-           >> order.status >> order.priority) {
-        orderQueue.push(order);
-        if (strcmp(order.status, "Delivered") == 0) {
-            siteBalance += order.totalAmount;
+    void readFrom(uint64_t id) {
+        auto it = connections.find(id);
+        if (it == connections.end()) return;
+        Connection& connection = it->second;
+        char buffer[16384];
+        while (true) {
+            ssize_t count = recv(connection.fd, buffer, sizeof(buffer), 0);
+            if (count > 0) {
+                connection.in.append(buffer, count);
+                continue;
+            }
+            if (count < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                closeConnection(id);
+                return;
+            }
+            if (count == 0) {
+                // Half-closed: requests already received are still answered
+                connection.peerClosed = true;
+                updateEvents(connection, id);
+            }
+            break;
         }
+        dispatchNext(id);
     }
-}
 
-void saveOrders() {
-    ofstream out(ordersFile);
-    if (!out) {
-        UI::printError("Error saving orders!");
-        return;
+    // Hands the next complete request of an idle connection to the workers
+    void dispatchNext(uint64_t id) {
+        auto it = connections.find(id);
+        if (it == connections.end()) return;
+        Connection& connection = it->second;
+        if (connection.busy) return;
+
+        Job job;
+        job.connection = id;
+        HttpParse parsed = parseHttpRequest(connection.in, job.request);
+        if (parsed == HTTP_INCOMPLETE) {
+            closeIfIdle(id);
+            return;
+        }
+        connection.busy = true;
+        if (parsed == HTTP_COMPLETE) {
+            lock_guard<mutex> guard(jobsMutex);
+            jobs.push_back(std::move(job));
+            jobsReady.notify_one();
+            return;
+        }
+
+        // The rest of the stream cannot be framed, so answer and hang up
+        int status = parsed == HTTP_TOO_LARGE ? 413 : 400;
+        countMetric(COUNTER_HTTP_ERRORS);
+        connection.closeAfterWrite = true;
+        connection.in.clear();
+        connection.out += formatHttpResponse(apiError(status, httpReason(status)), false);
+        flush(id);
     }
-    
-    // Temporary vector to hold orders
-    vector<Order> orders;
-    while (!orderQueue.empty()) {
-        orders.push_back(orderQueue.top());
-        orderQueue.pop();
+
+    void closeIfIdle(uint64_t id) {
+        auto it = connections.find(id);
+        if (it != connections.end() && it->second.peerClosed && !it->second.busy) closeConnection(id);
     }
-    
-    // Write to file
-    for (const Order& order : orders) {
-        out << order.username << '\t' << order.productName << '\t'
-           << order.quantity << '\t' << order.totalAmount << '\t'
-           << order.status << '\t' << order.priority << '\n';
-        orderQueue.push(order); // Restore queue
+
+    void deliverResponses() {
+        deque<Done> finished;
+        {
+            lock_guard<mutex> guard(doneMutex);
+            finished.swap(done);
+        }
+        for (Done& response : finished) {
+            auto it = connections.find(response.connection);
+            if (it == connections.end()) continue;  // The client went away meanwhile
+            it->second.out += response.response;
+            if (!response.keepAlive) it->second.closeAfterWrite = true;
+            flush(response.connection);
+        }
     }
-}
 
+    // Writes what the socket takes; the rest waits for EPOLLOUT
+    void flush(uint64_t id) {
+        auto it = connections.find(id);
+        if (it == connections.end()) return;
+        Connection& connection = it->second;
+        while (connection.sent < connection.out.size()) {
+            ssize_t count = send(connection.fd, connection.out.data() + connection.sent,
+                                 connection.out.size() - connection.sent, MSG_NOSIGNAL);
+            if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                setWriting(connection, id, true);
+                return;
+            }
+            if (count <= 0) {
+                closeConnection(id);
+                return;
+            }
+            connection.sent += count;
+        }
+        if (connection.out.empty()) return;  // Nothing was queued
 
-// UI Components
+        connection.out.clear();
+        connection.sent = 0;
+        setWriting(connection, id, false);
+        if (connection.closeAfterWrite) {
+            closeConnection(id);
+            return;
+        }
+        connection.busy = false;
+        dispatchNext(id);
+    }
 
-void displayMenu(const vector<string>& options, const string& title = "MENU") {
-    int width = 40;
-    cout << "+" << string(width, '-') << "+" << endl;
-    cout << "|" << UI::BOLD << setw(width) << left << ("  " + title) << UI::RESET << "|" << endl;
-    cout << "+" << string(width, '-') << "+" << endl;
-    
-    for (size_t i = 0; i < options.size(); i++) {
-        cout << "| " << UI::BOLD << setw(2) << left << (to_string(i+1) + ".") 
-             << UI::RESET << setw(width-3) << options[i] << "|" << endl;
+    void setWriting(Connection& connection, uint64_t id, bool writing) {
+        if (connection.writing == writing) return;
+        connection.writing = writing;
+        updateEvents(connection, id);
     }
-    
-    cout << "+" << string(width, '-') << "+" << endl;
-    cout << UI::BOLD << "Enter your choice: " << UI::RESET;
-}
 
-void displayProductTable() {
-    if (productHead == NULL) {
-        UI::printWarning("No products available!");
-        return;
+    // Level-triggered, so a half-closed socket stops asking to be read
+    void updateEvents(const Connection& connection, uint64_t id) {
+        epoll_event event = epoll_event();
+        event.events = 0;
+        if (!connection.peerClosed) event.events |= EPOLLIN | EPOLLRDHUP;
+        if (connection.writing) event.events |= EPOLLOUT;
+        event.data.u64 = id;
+        epoll_ctl(epollFd, EPOLL_CTL_MOD, connection.fd, &event);
     }
 
-    // Header
-    cout << "+------+----------------------+-----------+-----------+" << endl;
-    cout << "| " << left << setw(4) << "ID" << " | " 
-         << setw(20) << "Name" << " | " 
-         << setw(9) << "Price" << " | " 
-         << setw(9) << "Quantity" << " |" << endl;
-    cout << "+------+----------------------+-----------+-----------+" << endl;
-    
-    // Products
-    Product* current = productHead;
-    while (current != NULL) {
-        cout << "| " << UI::BOLD << setw(4) << current->id << UI::RESET << " | " 
-             << setw(20) << current->name << " | " 
-             << setw(9) << "$" + to_string(current->price).substr(0, 5) << " | " 
-             << setw(9) << current->quantity << " |" << endl;
-        current = current->next;
+    void closeConnection(uint64_t id) {
+        auto it = connections.find(id);
+        if (it == connections.end()) return;
+        ::close(it->second.fd);  // Also drops it from the epoll set
+        connections.erase(it);
     }
-    
-    // Footer
-    cout << "+------+----------------------+-----------+-----------+" << endl;
-}
 
-void displayCart() {
-    if (currentCart.empty()) {
-        UI::printWarning("Your cart is empty!");
-        return;
+    void workerLoop() {
+        while (true) {
+            Job job;
+            {
+                unique_lock<mutex> lock(jobsMutex);
+                jobsReady.wait(lock, [this] { return stopping || !jobs.empty(); });
+                if (jobs.empty()) return;
+                job = std::move(jobs.front());
+                jobs.pop_front();
+            }
+            HttpResponse response = handleApiRequest(job.request);
+            {
+                lock_guard<mutex> guard(doneMutex);
+                done.push_back(Done{job.connection, formatHttpResponse(response, job.request.keepAlive),
+                                    job.request.keepAlive});
+            }
+            uint64_t one = 1;
+            ssize_t ignored = write(wakeFd, &one, sizeof(one));
+            (void)ignored;
+        }
     }
 
-    float total = 0.0f;
-    
-    cout << UI::YELLOW << UI::BOLD << "Your Shopping Cart" << UI::RESET << endl;
-    cout << "+------------------------+-------+-----------+" << endl;
-    cout << "| " << left << setw(24) << "Product" 
-         << "| " << setw(5) << "Qty" 
-         << "| " << setw(9) << "Subtotal" << "|" << endl;
-    cout << "+------------------------+-------+-----------+" << endl;
-    
-    for (const auto& item : currentCart) {
-        float subtotal = item.price * item.quantity;
-        cout << "| " << left << setw(24) << item.productName 
-             << "| " << setw(5) << item.quantity 
-             << "| " << setw(9) << "$" + to_string(subtotal).substr(0, 6) 
-             << "|" << endl;
-        total += subtotal;
+    void closeAll() {
+        for (auto& entry : connections) ::close(entry.second.fd);
+        connections.clear();
+        for (int fd : {listenFd, epollFd, wakeFd}) {
+            if (fd >= 0) ::close(fd);
+        }
+        listenFd = epollFd = wakeFd = -1;
     }
-    
-    cout << "+------------------------+-------+-----------+" << endl;
-    cout << "| " << left << setw(31) << "Total:" 
-         << " $" << setw(6) << total << "|" << endl;
-    cout << "+------------------------+-------+-----------+" << endl;
-}
 
+    int listenFd;
+    int epollFd;
+    int wakeFd;
+    uint64_t nextConnection;
+    unordered_map<uint64_t, Connection> connections;  // Only touched by the event loop
 
-// Core Functions
+    mutex jobsMutex;
+    condition_variable jobsReady;
+    deque<Job> jobs;
+    bool stopping;
+    vector<thread> workers;
 
-void adminLogin();
-void userLogin();
-void userRegistration();
-void adminMenu();
-void userMenu(const string& username);
-void addProduct();
-void processOrder(const string& username);
+    mutex doneMutex;
+    deque<Done> done;
+};
+
+int runServer(int port, int workers) {
+    HttpServer server;
+    if (!server.listen(port)) {
+        UI::printError("Cannot listen on 127.0.0.1:" + to_string(port) + ": " + strerror(errno));
+        return 1;
+    }
+    UI::printSuccess("Serving on http://127.0.0.1:" + to_string(port) + " with " + to_string(workers) +
+                     " workers; Ctrl+C stops.");
+    server.run(workers);
+    UI::printInfo("Server stopped.");
+    return 0;
+}
+
+#else
 
+int runServer(int, int) {
+    UI::printError("--serve needs Linux (epoll).");
+    return 1;
+}
 
-// Main Application
+#endif
 
-int main() {
+
+int main(int argc, char* argv[]) {
     ensureDataDirectoryExists();
+    loadConfig();
+
+    int convertTo = -1;
+    size_t benchRecords = 0;
+    vector<int> load;  // --loadgen shoppers, seconds, threads
+    const char* replayFile = NULL;
+    const char* recordFile = NULL;
+    int loadThreads = max(1u, thread::hardware_concurrency());
+    const char* scriptFile = NULL;
+    vector<int> serve;  // --serve port, workers
+    vector<string> transfer;  // --import/--export <kind> <file>
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--fast") {
+            UI::fastMode = true;
+        } else if (arg == "--script" && i + 1 < argc) {
+            scriptFile = argv[++i];
+        } else if (arg == "--stress-checkout") {
+            int threads = (i + 1 < argc) ? atoi(argv[++i]) : 8;
+            int rounds = (i + 1 < argc) ? atoi(argv[++i]) : 10000;
+            return runCheckoutStressTest(max(threads, 1), max(rounds, 1));
+        } else if ((arg == "--import" || arg == "--export") && i + 2 < argc) {
+            transfer = {arg.substr(2), argv[i + 1], argv[i + 2]};
+            i += 2;
+        } else if (arg == "--bench") {
+            // Accepts "1000000" as well as "1e6"
+            bool counted = i + 1 < argc && isdigit((unsigned char)argv[i + 1][0]);
+            benchRecords = counted ? (size_t)llround(strtod(argv[++i], NULL)) : 100000;
+        } else if (arg == "--loadgen") {
+            load = {1000, 10, loadThreads};
+            for (size_t n = 0; n < load.size() && i + 1 < argc && isdigit((unsigned char)argv[i + 1][0]); n++) {
+                load[n] = max(1, atoi(argv[++i]));
+            }
+        } else if (arg == "--replay" && i + 1 < argc) {
+            replayFile = argv[++i];
+            if (i + 1 < argc && isdigit((unsigned char)argv[i + 1][0])) loadThreads = max(1, atoi(argv[++i]));
+        } else if (arg == "--serve") {
+            serve = {8080, loadThreads};
+            for (size_t n = 0; n < serve.size() && i + 1 < argc && isdigit((unsigned char)argv[i + 1][0]); n++) {
+                serve[n] = max(1, atoi(argv[++i]));
+            }
+        } else if (arg == "--record" && i + 1 < argc) {
+            recordFile = argv[++i];
+        } else if (arg == "--fulfillment" && i + 1 < argc) {
+            fulfillmentWorkers = max(0, atoi(argv[++i]));
+        } else if (arg == "--metrics") {
+            metricsEnabled = true;
+        } else if (arg == "--binary") {
+            binarySnapshots = true;
+        } else if (arg == "--convert-to-binary") {
+            convertTo = 1;
+        } else if (arg == "--convert-to-text") {
+            convertTo = 0;
+        } else {
+            UI::printError("Unknown option: " + arg);
+            cout << "Usage: " << argv[0] << " [--fast] [--binary] [--metrics] [--fulfillment <workers>] [--script <file|->"
+                 << " | --import <kind> <file> | --export <kind> <file>"
+                 << " | --convert-to-binary | --convert-to-text"
+                 << " | --stress-checkout [threads] [rounds] | --bench [max records]"
+                 << " | --loadgen [shoppers] [seconds] [threads] [--record <file>] | --replay <file> [threads]"
+                 << " | --serve [port] [workers]]" << endl;
+            return 1;
+        }
+    }
+
+    if (benchRecords > 0) {
+        return runBenchmarks(benchRecords);
+    }
+    if (!load.empty()) {
+        return runLoadGenerator(load[0], load[1], load[2], recordFile);
+    }
+    if (replayFile != NULL) {
+        return runReplay(replayFile, loadThreads);
+    }
     
     // Initialize required files
     const char* files[] = {adminFile, userFile, ordersFile, productsFile};
     for (const char* file : files) {
         if (!fileExists(file)) {
-            ofstream out(file);
+            AtomicFileWriter out(file, AtomicFileWriter::CHECKSUM_FOOTER);
             if (strcmp(file, adminFile) == 0) {
-                out << "admin123\n"; // Default admin password
+                out.write(hashPassword("admin123", passwordIterations) + "\n"); // Default admin password
             }
-            out.close();
+            out.commit();
         }
     }
 
+    if (convertTo >= 0) {
+        return convertSnapshots(convertTo == 1);
+    }
+
     // Load data
     loadUsers();
     loadProducts();
     loadOrders();
+    orderJournal.open();
+    if (orderJournal.hasPendingRecords()) {
+        saveOrders(); // Fold a journal left by the previous run into the snapshot
+    }
+    // Data from before the ledger existed: the balance was the delivered order total
+    Money openingBalance = Money::fromCents(0);
+    if (!ledger.load()) {
+        openingBalance = Money::fromCents(orderStore.analytics().totals().deliveredCents);
+    }
+    ledger.open(openingBalance);
+    productPersistence.start();
+    metricsExporter.start();
+    store.startSessions();
+    fulfillmentCenter.start(fulfillmentWorkers);
+
+    if (!transfer.empty()) {
+        string error = transferBulkData(transfer[0], transfer[1], transfer[2]);
+        if (!error.empty()) UI::printError(error);
+        shutdownStore();
+        return error.empty() ? 0 : 1;
+    }
+
+    if (!serve.empty()) {
+        int result = runServer(serve[0], serve[1]);
+        shutdownStore();
+        return result;
+    }
+
+    if (scriptFile != NULL) {
+        int failures;
+        if (strcmp(scriptFile, "-") == 0) {
+            failures = ScriptRunner().run(cin);
+        } else {
+            ifstream script(scriptFile);
+            if (!script) {
+                UI::printError(string("Cannot open script ") + scriptFile);
+                return 1;
+            }
+            failures = ScriptRunner().run(script);
+        }
+        shutdownStore();
+        return failures == 0 ? 0 : 1;
+    }
 
     UI::clearScreen();
     cout << UI::MAGENTA << UI::BOLD << "=== E-Commerce System ===" << UI::RESET << endl << endl;
@@ -423,8 +6266,7 @@ int main() {
         };
         
         displayMenu(mainMenu, "MAIN MENU");
-        cin >> choice;
-        cin.ignore();
+        choice = readMenuChoice(4);
         
         switch (choice) {
             case 1: adminLogin(); break;
@@ -439,36 +6281,23 @@ int main() {
         }
     } while (choice != 4);
 
-    // Cleanup
-    Product* current = productHead;
-    while (current != NULL) {
-        Product* temp = current;
-        current = current->next;
-        delete temp;
-    }
+    shutdownStore();
 
     return 0;
 }
 
 void adminLogin() {
     UI::clearScreen();
-    ifstream in(adminFile);
-    if (!in) {
-        UI::printError("Error opening admin file!");
-        return;
-    }
-
-    string storedPassword;
-    in >> storedPassword;
-    in.close();
-
     string enteredPassword = getInput("Enter admin password: ");
+    StoreResult result = store.adminLogin(enteredPassword);
 
-    if (enteredPassword == storedPassword) {
+    if (result == STORE_OK) {
         UI::showLoadingAnimation(2);
         UI::printSuccess("Login successful!");
         UI::sleepMilliseconds(1000);
         adminMenu();
+    } else if (result == STORAGE_ERROR) {
+        UI::printError("Error opening admin file!");
     } else {
         UI::showLoadingAnimation(2);
         UI::printError("Incorrect password!");
@@ -481,26 +6310,23 @@ void userRegistration() {
     cout << UI::BOLD << "USER REGISTRATION\n" << UI::RESET;
     UI::drawHorizontalLine(30);
     
-    User newUser;
-    
     string username = getInput("Enter username: ", [](const string& s) {
-        return !s.empty() && userMap.find(s) == userMap.end();
+        return usernameValid(s) && !store.userExists(s);
     }, "Username already exists or is invalid!");
-    strcpy(newUser.username, username.c_str());
     
-    string password = getInput("Enter password: ", [](const string& s) {
-        return s.length() >= 6 && containsAlphabet(s) && containsDigits(s);
-    }, "Password must be at least 6 characters with both letters and numbers!");
-    strcpy(newUser.password, password.c_str());
+    string password = getInput("Enter password: ", passwordValid,
+        "Password must be at least 6 characters with both letters and numbers!");
     
     string email = getInput("Enter email: ", emailValid, "Invalid email format!");
-    strcpy(newUser.email, email.c_str());
 
-    userMap[newUser.username] = newUser;
-    saveUsers();
+    StoreResult result = store.registerUser(username, password, email);
 
     UI::showLoadingAnimation(2);
-    UI::printSuccess("Registration successful!");
+    if (result == STORE_OK) {
+        UI::printSuccess("Registration successful!");
+    } else {
+        UI::printError(describe(result));
+    }
     UI::sleepMilliseconds(1500);
 }
 
@@ -512,8 +6338,7 @@ void userLogin() {
     string username = getInput("Enter username: ");
     string password = getInput("Enter password: ");
 
-    auto it = userMap.find(username);
-    if (it != userMap.end() && strcmp(it->second.password, password.c_str()) == 0) {
+    if (store.login(username, password) == STORE_OK) {
         UI::showLoadingAnimation(2);
         UI::printSuccess("Login successful!");
         UI::sleepMilliseconds(1000);
@@ -530,111 +6355,66 @@ void addProduct() {
     cout << UI::BOLD << "ADD NEW PRODUCT\n" << UI::RESET;
     UI::drawHorizontalLine(30);
     
-    Product newProduct;
-    newProduct.id = nextProductId++;
-    
     string name = getInput("Enter product name: ");
-    strcpy(newProduct.name, name.c_str());
-    
-    string priceStr = getInput("Enter product price: ", [](const string& s) {
-        try {
-            stof(s);
-            return true;
-        } catch (...) {
-            return false;
-        }
-    }, "Invalid price! Enter a number.");
-    newProduct.price = stof(priceStr);
-    
-    string quantityStr = getInput("Enter product quantity: ", [](const string& s) {
-        try {
-            stoi(s);
-            return true;
-        } catch (...) {
-            return false;
-        }
-    }, "Invalid quantity! Enter a whole number.");
-    newProduct.quantity = stoi(quantityStr);
+    string priceStr = getInput("Enter product price: ", priceValid, "Invalid price! Enter a number.");
+    string quantityStr = getInput("Enter product quantity: ", quantityValid,
+        "Invalid quantity! Enter a whole number.");
     
-    addProductToLinkedList(newProduct);
-    saveProducts();
+    StoreResult result = store.addProduct(name, toMoney(priceStr), stoi(quantityStr));
     
     UI::showLoadingAnimation(2);
-    UI::printSuccess("Product added successfully!");
+    if (result == STORE_OK) {
+        UI::printSuccess("Product added successfully!");
+    } else {
+        UI::printError(describe(result));
+    }
     UI::sleepMilliseconds(1500);
 }
 
 void addToCart(const string& username) {
-    displayProductTable();
-    if (productHead == NULL) {
+    browseProducts();
+    if (catalog.empty()) {
         UI::sleepMilliseconds(1500);
         return;
     }
 
-    string productIdStr = getInput("Enter product ID to add to cart (0 to cancel): ", [](const string& s) {
-        try {
-            stoi(s);
-            return true;
-        } catch (...) {
-            return false;
-        }
-    }, "Invalid ID! Enter a number.");
+    string productIdStr = getInput("Enter product ID to add to cart (0 to cancel): ", quantityValid,
+        "Invalid ID! Enter a number.");
     
     int productId = stoi(productIdStr);
     if (productId == 0) return;
 
-    // Find product
-    Product* current = productHead;
-    while (current != NULL && current->id != productId) {
-        current = current->next;
-    }
-
-    if (current == NULL) {
+    Product product = Product();
+    if (!catalog.findById(productId, product)) {
         UI::printError("Product not found!");
         UI::sleepMilliseconds(1500);
         return;
     }
 
     string quantityStr = getInput("Enter quantity: ", [](const string& s) {
-        try {
-            int q = stoi(s);
-            return q > 0;
-        } catch (...) {
-            return false;
-        }
+        return quantityValid(s) && stoi(s) > 0;
     }, "Invalid quantity! Enter a positive number.");
     
-    int quantity = stoi(quantityStr);
-    
-    if (quantity > current->quantity) {
-        UI::printError("Not enough stock available!");
+    StoreResult result = store.addToCart(username, productId, stoi(quantityStr));
+    if (result != STORE_OK) {
+        UI::printError(describe(result));
         UI::sleepMilliseconds(1500);
         return;
     }
 
-    // Add to cart
-    CartItem item;
-    strcpy(item.productName, current->name);
-    item.price = current->price;
-    item.quantity = quantity;
-    currentCart.push_back(item);
-
-    // Update product quantity
-    current->quantity -= quantity;
-    saveProducts();
-
     UI::printSuccess("Product added to cart!");
     UI::sleepMilliseconds(1500);
 }
 
 void checkout(const string& username) {
-    if (currentCart.empty()) {
+    vector<CartItem> cart = store.cart(username);
+    if (cart.empty()) {
         UI::printWarning("Your cart is empty!");
         UI::sleepMilliseconds(1500);
         return;
     }
 
-    displayCart();
+    displayCart(cart);
     cout << "\nConfirm checkout? (y/n): ";
     char confirm;
     cin >> confirm;
@@ -646,55 +6426,64 @@ void checkout(const string& username) {
         return;
     }
 
-    // Create orders
-    float totalAmount = 0.0f;
-    for (const auto& item : currentCart) {
-        Order order;
-        strcpy(order.username, username.c_str());
-        strcpy(order.productName, item.productName);
-        order.quantity = item.quantity;
-        order.totalAmount = item.price * item.quantity;
-        strcpy(order.status, "Pending");
-        order.priority = (username.find("premium") != string::npos) ? 2 : 1;
-        
-        orderQueue.push(order);
-        totalAmount += order.totalAmount;
+    Money totalAmount;
+    if (store.checkout(username, totalAmount) != STORE_OK) {
+        UI::printWarning("Your cart is empty!");  // Expired while the prompt was open
+        UI::sleepMilliseconds(1500);
+        return;
     }
 
-    saveOrders();
-    currentCart.clear();
-
     UI::showLoadingAnimation(3);
-    UI::printSuccess("Checkout successful! Total: $" + to_string(totalAmount).substr(0, 6));
+    UI::printSuccess("Checkout successful! Total: $" + totalAmount.str());
     UI::sleepMilliseconds(2000);
 }
 
+void searchProducts() {
+    UI::clearScreen();
+    cout << UI::BOLD << "SEARCH PRODUCTS\n" << UI::RESET;
+    UI::drawHorizontalLine(30);
+
+    ProductQuery query;
+    query.text = getInput("Name contains (blank for any): ");
+    if (!query.text.empty()) {
+        query.prefixOnly = tolower(getInput("Match start of name only? (y/n): ")[0]) == 'y';
+    }
+    auto optionalPrice = [](const string& s) { return s.empty() || priceValid(s); };
+    string minPrice = getInput("Minimum price (blank for none): ", optionalPrice, "Invalid price! Enter a number.");
+    string maxPrice = getInput("Maximum price (blank for none): ", optionalPrice, "Invalid price! Enter a number.");
+    if (!minPrice.empty()) query.minPrice = toMoney(minPrice);
+    if (!maxPrice.empty()) query.maxPrice = toMoney(maxPrice);
+    query.inStockOnly = tolower(getInput("In stock only? (y/n): ")[0]) == 'y';
+
+    vector<Product> results = store.searchProducts(query);
+    if (results.empty()) {
+        UI::printWarning("No matching products!");
+    } else {
+        ProductTableRenderer().render(results);
+        if (results.size() == query.limit) {
+            UI::printInfo("Showing the first " + to_string(query.limit) + " matches; refine the search to see more.");
+        }
+    }
+
+    cout << "Press Enter to continue...";
+    cin.get();
+}
+
 void viewOrderHistory(const string& username) {
     UI::clearScreen();
     cout << UI::BOLD << "ORDER HISTORY FOR " << username << "\n" << UI::RESET;
     UI::drawHorizontalLine(50);
     
-    bool found = false;
-    vector<Order> orders;
-    
-    while (!orderQueue.empty()) {
-        orders.push_back(orderQueue.top());
-        orderQueue.pop();
-    }
-    
-    for (const Order& order : orders) {
-        if (string(order.username) == username && string(order.status) == "Delivered") {
-            found = true;
-            cout << "Product: " << order.productName << endl;
-            cout << "Quantity: " << order.quantity << endl;
-            cout << "Amount: $" << order.totalAmount << endl;
-            cout << "Status: " << order.status << endl;
-            UI::drawHorizontalLine(50);
-        }
-        orderQueue.push(order);
+    vector<Order> history = store.orderHistory(username);
+    for (const Order& order : history) {
+        cout << "Product: " << order.productName << endl;
+        cout << "Quantity: " << order.quantity << endl;
+        cout << "Amount: $" << order.totalAmount << endl;
+        cout << "Status: " << order.status << endl;
+        UI::drawHorizontalLine(50);
     }
     
-    if (!found) {
+    if (history.empty()) {
         UI::printWarning("No order history found!");
     }
     
@@ -703,6 +6492,87 @@ void viewOrderHistory(const string& username) {
     cin.get();
 }
 
+string formatCents(long long cents) {
+    return "$" + Money::fromCents(cents).str();
+}
+
+void printSalesRankings(const string& title, const vector<SalesRanking>& rankings) {
+    cout << UI::BOLD << title << UI::RESET << "\n";
+    cout << "+----------------------+--------+--------+--------------+--------------+" << endl;
+    cout << "| " << left << setw(21) << "Name" << "| " << setw(7) << "Orders" << "| "
+         << setw(7) << "Units" << "| " << setw(13) << "Pending" << "| " << setw(13) << "Delivered" << "|" << endl;
+    cout << "+----------------------+--------+--------+--------------+--------------+" << endl;
+    for (const SalesRanking& ranking : rankings) {
+        cout << "| " << setw(21) << ranking.key << "| " << setw(7) << ranking.totals.orders << "| "
+             << setw(7) << ranking.totals.units << "| " << setw(13) << formatCents(ranking.totals.pendingCents)
+             << "| " << setw(13) << formatCents(ranking.totals.deliveredCents) << "|" << endl;
+    }
+    cout << "+----------------------+--------+--------+--------------+--------------+" << endl;
+}
+
+void salesReport() {
+    UI::clearScreen();
+    cout << UI::BOLD << "SALES REPORT\n" << UI::RESET;
+    UI::drawHorizontalLine(30);
+
+    SalesTotals totals = store.salesTotals();
+    cout << "Orders: " << totals.orders << "   Units sold: " << totals.units << "\n";
+    cout << "Pending revenue:   " << formatCents(totals.pendingCents) << "\n";
+    cout << "Delivered revenue: " << formatCents(totals.deliveredCents) << "\n\n";
+
+    printSalesRankings("TOP PRODUCTS", store.topProducts(10));
+    cout << endl;
+    printSalesRankings("TOP CUSTOMERS", store.topCustomers(10));
+
+    if (fulfillmentCenter.running()) {
+        FulfillmentStats premium = fulfillmentCenter.stats(FulfillmentCenter::PREMIUM);
+        FulfillmentStats standard = fulfillmentCenter.stats(FulfillmentCenter::STANDARD);
+        cout << "\n" << UI::BOLD << "FULFILLMENT (checkout to delivery)" << UI::RESET << "\n";
+        cout << "Premium:  " << premium.delivered << " delivered, average " << premium.averageMicroseconds / 1000
+             << " ms, max " << premium.maxMicroseconds / 1000 << " ms\n";
+        cout << "Standard: " << standard.delivered << " delivered, average " << standard.averageMicroseconds / 1000
+             << " ms, max " << standard.maxMicroseconds / 1000 << " ms\n";
+    }
+
+    cout << "Press Enter to continue...";
+    cin.ignore();
+    cin.get();
+}
+
+void metricsReport() {
+    UI::clearScreen();
+    cout << UI::BOLD << "METRICS\n" << UI::RESET;
+    UI::drawHorizontalLine(30);
+
+    if (!metricsEnabled) {
+        UI::printWarning("Metrics are off; start with --metrics or set metrics=1 in data/config.txt.");
+    } else {
+        MetricsSnapshot snapshot = metrics.snapshot();
+        cout << left << setw(16) << "Operation" << right << setw(10) << "Calls" << setw(12) << "Mean us"
+             << setw(12) << "p50 us" << setw(12) << "p99 us" << setw(12) << "Max us" << "\n";
+        for (int m = 0; m < METRIC_COUNT; m++) {
+            const TimerTotals& timer = snapshot.timers[m];
+            if (timer.count == 0) continue;
+            cout << left << setw(16) << metricNames[m] << right << setw(10) << timer.count
+                 << fixed << setprecision(1)
+                 << setw(12) << timer.totalNanoseconds / 1000.0 / timer.count
+                 << setw(12) << timer.quantileNanoseconds(0.5) / 1000.0
+                 << setw(12) << timer.quantileNanoseconds(0.99) / 1000.0
+                 << setw(12) << timer.maxNanoseconds / 1000.0 << "\n";
+        }
+        cout << "\n";
+        for (int c = 0; c < COUNTER_COUNT; c++) {
+            cout << left << setw(18) << counterNames[c] << right << setw(10) << snapshot.counters[c] << "\n";
+        }
+        cout << "\nPercentiles are bucket upper bounds. " << metricsFile << " is rewritten every "
+             << metricsDumpSeconds << " s and at exit.\n";
+    }
+
+    cout << "Press Enter to continue...";
+    cin.ignore();
+    cin.get();
+}
+
 void adminMenu() {
     int choice;
     do {
@@ -715,19 +6585,20 @@ void adminMenu() {
             "View All Orders",
             "Mark Order as Delivered",
             "Add Product",
+            "Sales Report",
+            "Metrics",
             "Logout"
         };
         displayMenu(options, "ADMIN DASHBOARD");
         
-        cin >> choice;
-        cin.ignore();
+        choice = readMenuChoice(10);
         
         switch (choice) {
             case 1: {
                 UI::clearScreen();
                 cout << UI::BOLD << "SITE BALANCE\n" << UI::RESET;
                 UI::drawHorizontalLine(20);
-                cout << "Current balance: $" << siteBalance << "\n";
+                cout << "Current balance: $" << store.balance() << "\n";
                 cout << "Press Enter to continue...";
                 cin.ignore();
                 break;
@@ -736,27 +6607,19 @@ void adminMenu() {
                 UI::clearScreen();
                 cout << UI::BOLD << "WITHDRAW FUNDS\n" << UI::RESET;
                 UI::drawHorizontalLine(20);
-                cout << "Current balance: $" << siteBalance << "\n";
-                
-                string amountStr = getInput("Enter amount to withdraw: ", [](const string& s) {
-                    try {
-                        float amt = stof(s);
-                        return amt > 0;
-                    } catch (...) {
-                        return false;
-                    }
-                }, "Invalid amount! Enter a positive number.");
+                cout << "Current balance: $" << store.balance() << "\n";
                 
-                float amount = stof(amountStr);
+                string amountStr = getInput("Enter amount to withdraw: ", positiveAmountValid,
+                    "Invalid amount! Enter a positive number.");
                 
-                if (amount > siteBalance) {
-                    UI::printError("Insufficient funds!");
+                StoreResult result = store.withdraw(toMoney(amountStr));
+                if (result != STORE_OK) {
+                    UI::printError(describe(result));
                     UI::sleepMilliseconds(1500);
                     break;
                 }
                 
-                siteBalance -= amount;
-                UI::printSuccess("Withdrawal successful! New balance: $" + to_string(siteBalance).substr(0, 6));
+                UI::printSuccess("Withdrawal successful! New balance: $" + store.balance().str());
                 UI::sleepMilliseconds(2000);
                 break;
             }
@@ -765,19 +6628,12 @@ void adminMenu() {
                 cout << UI::BOLD << "ADD FUNDS\n" << UI::RESET;
                 UI::drawHorizontalLine(20);
                 
-                string amountStr = getInput("Enter amount to deposit: ", [](const string& s) {
-                    try {
-                        float amt = stof(s);
-                        return amt > 0;
-                    } catch (...) {
-                        return false;
-                    }
-                }, "Invalid amount! Enter a positive number.");
+                string amountStr = getInput("Enter amount to deposit: ", positiveAmountValid,
+                    "Invalid amount! Enter a positive number.");
                 
-                float amount = stof(amountStr);
-                siteBalance += amount;
+                store.deposit(toMoney(amountStr));
                 
-                UI::printSuccess("Deposit successful! New balance: $" + to_string(siteBalance).substr(0, 6));
+                UI::printSuccess("Deposit successful! New balance: $" + store.balance().str());
                 UI::sleepMilliseconds(2000);
                 break;
             }
@@ -786,27 +6642,18 @@ void adminMenu() {
                 cout << UI::BOLD << "CHANGE ADMIN PASSWORD\n" << UI::RESET;
                 UI::drawHorizontalLine(30);
                 
-                ifstream in(adminFile);
-                string currentPassword;
-                in >> currentPassword;
-                in.close();
-                
                 string entered = getInput("Enter current password: ");
-                if (entered != currentPassword) {
+                string newPass = getInput("Enter new password: ", passwordValid,
+                    "Password must be at least 6 characters with both letters and numbers!");
+                
+                StoreResult result = store.changeAdminPassword(entered, newPass);
+                if (result == STORE_OK) {
+                    UI::printSuccess("Password changed successfully!");
+                } else if (result == BAD_CREDENTIALS) {
                     UI::printError("Incorrect password!");
-                    UI::sleepMilliseconds(1500);
-                    break;
+                } else {
+                    UI::printError(describe(result));
                 }
-                
-                string newPass = getInput("Enter new password: ", [](const string& s) {
-                    return s.length() >= 6 && containsAlphabet(s) && containsDigits(s);
-                }, "Password must be at least 6 characters with both letters and numbers!");
-                
-                ofstream out(adminFile);
-                out << newPass;
-                out.close();
-                
-                UI::printSuccess("Password changed successfully!");
                 UI::sleepMilliseconds(1500);
                 break;
             }
@@ -814,28 +6661,23 @@ void adminMenu() {
                 UI::clearScreen();
                 cout << UI::BOLD << "ALL ORDERS\n" << UI::RESET;
                 
-                vector<Order> orders;
-                while (!orderQueue.empty()) {
-                    orders.push_back(orderQueue.top());
-                    orderQueue.pop();
-                }
-                
-                cout << "+----------------------+---------+---------+--------------+" << endl;
-                cout << "| " << left << setw(20) << "Customer" << "| " 
+                cout << "+--------+----------------------+---------+---------+--------------+" << endl;
+                cout << "| " << left << setw(7) << "ID" << "| "
+                     << setw(20) << "Customer" << "| " 
                      << setw(7) << "Product" << "| " 
                      << setw(7) << "Quantity" << "| " 
                      << setw(12) << "Status" << "|" << endl;
                 
-                for (const Order& order : orders) {
-                    cout << "+----------------------+---------+---------+--------------+" << endl;
-                    cout << "| " << setw(20) << order.username << "| " 
+                for (const Order& order : store.orders()) {
+                    cout << "+--------+----------------------+---------+---------+--------------+" << endl;
+                    cout << "| " << setw(7) << order.id << "| "
+                         << setw(20) << order.username << "| " 
                          << setw(7) << order.productName << "| " 
                          << setw(7) << order.quantity << "| " 
                          << setw(12) << order.status << "|" << endl;
-                    orderQueue.push(order);
                 }
                 
-                cout << "+----------------------+---------+---------+--------------+" << endl;
+                cout << "+--------+----------------------+---------+---------+--------------+" << endl;
                 cout << "Press Enter to continue...";
                 cin.ignore();
                 cin.get();
@@ -845,62 +6687,41 @@ void adminMenu() {
                 UI::clearScreen();
                 cout << UI::BOLD << "MARK ORDER AS DELIVERED\n" << UI::RESET;
                 
-                vector<Order> pendingOrders;
-                vector<Order> allOrders;
-                
-                while (!orderQueue.empty()) {
-                    Order order = orderQueue.top();
-                    if (string(order.status) == "Pending") {
-                        pendingOrders.push_back(order);
-                    }
-                    allOrders.push_back(order);
-                    orderQueue.pop();
-                }
-                
+                vector<Order> pendingOrders = store.orders("Pending");
                 if (pendingOrders.empty()) {
                     UI::printWarning("No pending orders!");
                     UI::sleepMilliseconds(1500);
-                    // Restore queue
-                    for (const Order& order : allOrders) {
-                        orderQueue.push(order);
-                    }
                     break;
                 }
                 
-                cout << "+----------------------+---------+---------+--------------+" << endl;
-                cout << "| " << left << setw(20) << "Customer" << "| " 
+                cout << "+--------+----------------------+---------+---------+--------------+" << endl;
+                cout << "| " << left << setw(7) << "ID" << "| "
+                     << setw(20) << "Customer" << "| " 
                      << setw(7) << "Product" << "| " 
                      << setw(7) << "Quantity" << "| " 
                      << setw(12) << "Amount" << "|" << endl;
                 
                 for (const Order& order : pendingOrders) {
-                    cout << "+----------------------+---------+---------+--------------+" << endl;
-                    cout << "| " << setw(20) << order.username << "| " 
+                    cout << "+--------+----------------------+---------+---------+--------------+" << endl;
+                    cout << "| " << setw(7) << order.id << "| "
+                         << setw(20) << order.username << "| " 
                          << setw(7) << order.productName << "| " 
                          << setw(7) << order.quantity << "| " 
-                         << setw(12) << "$" + to_string(order.totalAmount).substr(0, 6) << "|" << endl;
+                         << setw(12) << "$" + order.totalAmount.str() << "|" << endl;
                 }
                 
-                cout << "+----------------------+---------+---------+--------------+" << endl;
+                cout << "+--------+----------------------+---------+---------+--------------+" << endl;
                 cout << endl;
                 
-                string username = getInput("Enter customer username to mark as delivered: ");
-                
-                bool found = false;
-                for (Order& order : allOrders) {
-                    if (string(order.username) == username && string(order.status) == "Pending") {
-                        strcpy(order.status, "Delivered");
-                        siteBalance += order.totalAmount;
-                        found = true;
-                    }
-                    orderQueue.push(order);
-                }
+                string orderId = getInput("Enter order ID to mark as delivered (0 to cancel): ", quantityValid,
+                    "Invalid ID! Enter a number.");
+                if (stoll(orderId) == 0) break;
                 
-                if (found) {
-                    saveOrders();
+                StoreResult result = store.markOrderDelivered(stoll(orderId));
+                if (result == STORE_OK) {
                     UI::printSuccess("Order marked as delivered!");
                 } else {
-                    UI::printError("No pending orders found for that username!");
+                    UI::printError(describe(result));
                 }
                 UI::sleepMilliseconds(1500);
                 break;
@@ -910,6 +6731,14 @@ void adminMenu() {
                 break;
             }
             case 8: {
+                salesReport();
+                break;
+            }
+            case 9: {
+                metricsReport();
+                break;
+            }
+            case 10: {
                 UI::printInfo("Logging out...");
                 UI::sleepMilliseconds(1000);
                 break;
@@ -919,7 +6748,7 @@ void adminMenu() {
                 UI::sleepMilliseconds(1000);
             }
         }
-    } while (choice != 8);
+    } while (choice != 10);
 }
 
 void userMenu(const string& username) {
@@ -932,19 +6761,16 @@ void userMenu(const string& username) {
             "View Cart",
             "Checkout",
             "View Order History",
+            "Search Products",
             "Logout"
         };
         displayMenu(options, "USER MENU - " + username);
         
-        cin >> choice;
-        cin.ignore();
+        choice = readMenuChoice(7);
         
         switch (choice) {
             case 1: {
-                displayProductTable();
-                cout << "Press Enter to continue...";
-                cin.ignore();
-                cin.get();
+                browseProducts();
                 break;
             }
             case 2: {
@@ -952,7 +6778,7 @@ void userMenu(const string& username) {
                 break;
             }
             case 3: {
-                displayCart();
+                displayCart(store.cart(username));
                 cout << "Press Enter to continue...";
                 cin.ignore();
                 cin.get();
@@ -967,6 +6793,10 @@ void userMenu(const string& username) {
                 break;
             }
             case 6: {
+                searchProducts();
+                break;
+            }
+            case 7: {
                 UI::printInfo("Logging out...");
                 UI::sleepMilliseconds(1000);
                 break;
@@ -976,5 +6806,5 @@ void userMenu(const string& username) {
                 UI::sleepMilliseconds(1000);
             }
         }
-    } while (choice != 6);
+    } while (choice != 7);
 }